@@ -205,6 +205,8 @@ typedef int	msec_t;
 msec_t sys_milliseconds (void);
 #endif
 
+int64_t sys_microseconds (void);
+
 #define TIMEOUT_INFINITE	((msec_t) -1)
 
 
@@ -233,6 +235,13 @@ struct sys_buffer {
 int sys_buffer_read_init (lua_State *L, int idx, struct sys_buffer *sb);
 void sys_buffer_read_next (struct sys_buffer *sb, const size_t n);
 
+#define SYS_IOV_MAX	32  /* maximum buffers per vectored write */
+
+int sys_buffer_read_initv (lua_State *L, int *idxp, const int top,
+                           struct sys_buffer *sbs, const int nmax);
+void sys_buffer_read_nextv (struct sys_buffer *sbs, const int nbuf,
+                            size_t n);
+
 void sys_buffer_write_init (lua_State *L, int idx, struct sys_buffer *sb,
                             char *buf, const size_t buflen);
 int sys_buffer_write_next (lua_State *L, struct sys_buffer *sb,
@@ -77,8 +77,20 @@ evq_add (struct event_queue *evq, struct event *ev)
     epev.events = ((ev_flags & EVENT_READ) ? EPOLLIN : EPOLLOUT)
      | ((ev_flags & EVENT_ONESHOT) ? EPOLLONESHOT : 0);
     epev.data.ptr = ev;
-    if (epoll_ctl(evq->epoll_fd, EPOLL_CTL_ADD, ev->fd, &epev) == -1)
+
+    if (ev_flags & EVENT_SOCKET_ERRQUEUE) {
+      /* watch only EPOLLERR on separate descriptor of socket;
+         it keeps the socket open until the event is deleted */
+      ev->fd = fcntl(ev->fd, F_DUPFD_CLOEXEC, 0);
+      if (ev->fd == -1) return -1;
+      epev.events &= EPOLLONESHOT;
+    }
+
+    if (epoll_ctl(evq->epoll_fd, EPOLL_CTL_ADD, ev->fd, &epev) == -1) {
+      if (ev_flags & EVENT_SOCKET_ERRQUEUE)
+        close(ev->fd);
       return -1;
+    }
   }
 
   evq->nevents++;
@@ -126,6 +138,11 @@ evq_del (struct event *ev, const int reuse_fd)
   if (ev_flags & EVENT_DIRWATCH)
     return close(ev->fd);
 
+  if (ev_flags & EVENT_SOCKET_ERRQUEUE) {
+    epoll_ctl(evq->epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
+    return close(ev->fd);
+  }
+
   if (reuse_fd)
     epoll_ctl(evq->epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
   return 0;
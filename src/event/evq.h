@@ -45,6 +45,7 @@ struct event {
 #define EVENT_TIMEOUT_MANUAL	0x00000800  /* don't auto-reset timeout on event */
 #define EVENT_AIO		0x00001000
 #define EVENT_SOCKET_ACC_CONN	0x00002000  /* socket is listening or connecting */
+#define EVENT_SOCKET_ERRQUEUE	0x00004000  /* socket's error queue (zerocopy completions) */
 #define EVENT_CALLBACK		0x00010000  /* callback exists */
 #define EVENT_CALLBACK_CORO	0x00020000  /* callback is coroutine */
 #define EVENT_CALLBACK_SCHED	0x00040000  /* callback is scheduler */
@@ -8,6 +8,7 @@
 #ifndef _WIN32
 
 #include <sys/ioctl.h>
+#include <sys/uio.h>		/* writev */
 #include <sys/wait.h>
 #include <sys/resource.h>
 #if defined(BSD)
@@ -134,6 +134,41 @@ sys_buffer_read_next (struct sys_buffer *sb, const size_t n)
   }
 }
 
+/*
+ * Gather the non-empty buffers for vectored write.
+ * Arguments: ..., {string | membuf_udata} ...
+ * Returns: number of buffers
+ */
+int
+sys_buffer_read_initv (lua_State *L, int *idxp, const int top,
+                       struct sys_buffer *sbs, const int nmax)
+{
+  int idx = *idxp, n = 0;
+
+  for (; idx <= top && n < nmax; ++idx) {
+    if (sys_buffer_read_init(L, idx, &sbs[n]) && sbs[n].size)
+      ++n;
+  }
+  *idxp = idx;
+  return n;
+}
+
+/*
+ * Advance the gathered buffers by the number of written bytes.
+ */
+void
+sys_buffer_read_nextv (struct sys_buffer *sbs, const int nbuf, size_t n)
+{
+  int i;
+
+  for (i = 0; i < nbuf && n; ++i) {
+    const size_t len = (n < sbs[i].size) ? n : sbs[i].size;
+
+    sys_buffer_read_next(&sbs[i], len);
+    n -= len;
+  }
+}
+
 /*
  * Arguments: ..., [membuf_udata]
  */
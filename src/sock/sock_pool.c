@@ -0,0 +1,620 @@
+/* Lua System: Networking: Pool of outbound connections */
+
+#define POOL_TYPENAME	"sys.sock.conn_pool"
+
+#define POOL_MAX_CONN	8  /* default maximum connections per destination */
+
+struct conn_pool {
+  int max_conn;  /* maximum connections per destination */
+  int max_idle;  /* maximum idle connections per destination */
+};
+
+/* Environment of the pool */
+#define POOL_IDLE	1  /* key -> idle sockets (table: {sd_udata ...}) */
+#define POOL_NCONN	2  /* key -> number of connections */
+#define POOL_KEYS	3  /* sd_udata -> key */
+#define POOL_BUSY	4  /* sd_udata -> true (checked out) */
+#define POOL_EVIDS	5  /* sd_udata -> ev_ludata (watched idle) */
+#define POOL_EVQ	6  /* evq_udata */
+
+
+/*
+ * Returns: 1 when the idle connection is alive
+ */
+static int
+pool_alive (sd_t sd)
+{
+  char c;
+  int nr;
+
+#ifndef _WIN32
+  do nr = recv(sd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  while (nr == -1 && sys_eintr());
+#else
+  nr = recv(sd, &c, 1, MSG_PEEK);
+#endif
+  /* unexpected data or EOF: connection is not reusable */
+  return nr == -1 && SYS_IS_EAGAIN(SYS_ERRNO);
+}
+
+/*
+ * Arguments: ..., sd_udata
+ */
+static void
+pool_close_sd (lua_State *L)
+{
+  sd_t *sdp = lua_touserdata(L, -1);
+
+  if (*sdp != (sd_t) -1) {
+#ifndef _WIN32
+    int res;
+    do res = close(*sdp);
+    while (res == -1 && sys_eintr());
+#else
+    closesocket(*sdp);
+#endif
+    *sdp = (sd_t) -1;
+  }
+}
+
+/*
+ * Arguments: ..., env (table) at idx, key (string)
+ */
+static void
+pool_nconn_add (lua_State *L, const int env_idx, const int n)
+{
+  int nconn;
+
+  lua_rawgeti(L, env_idx, POOL_NCONN);
+  lua_pushvalue(L, -2);  /* key */
+  lua_rawget(L, -2);
+  nconn = (int) lua_tointeger(L, -1) + n;
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, -2);  /* key */
+  if (nconn > 0)
+    lua_pushinteger(L, nconn);
+  else
+    lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/*
+ * Forget the connection and close it.
+ * Arguments: ..., env (table) at idx, sd_udata
+ */
+static void
+pool_drop (lua_State *L, const int env_idx)
+{
+  lua_rawgeti(L, env_idx, POOL_KEYS);
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);  /* key */
+  if (!lua_isnil(L, -1))
+    pool_nconn_add(L, env_idx, -1);
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, -2);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  pool_close_sd(L);
+}
+
+/*
+ * Stop watching the idle connection.
+ * Arguments: ..., env (table) at idx, sd_udata
+ */
+static void
+pool_unwatch (lua_State *L, const int env_idx)
+{
+  lua_rawgeti(L, env_idx, POOL_EVIDS);
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);  /* ev_ludata */
+  if (!lua_isnil(L, -1)) {
+    lua_rawgeti(L, env_idx, POOL_EVQ);
+    lua_getfield(L, -1, "del");
+    lua_insert(L, -3);
+    lua_insert(L, -2);
+    lua_pushboolean(L, 1);  /* reuse_fd */
+    lua_call(L, 3, 0);
+
+    lua_pushvalue(L, -2);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+  } else {
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+ * Remove the idle connection from list.
+ * Arguments: ..., idle_list (table), sd_udata
+ */
+static void
+pool_idle_remove (lua_State *L)
+{
+  const int n = (int) lua_rawlen(L, -2);
+  int i;
+
+  for (i = 1; i <= n; ++i) {
+    lua_rawgeti(L, -2, i);
+    if (lua_rawequal(L, -1, -2)) {
+      lua_pop(L, 1);
+      lua_rawgeti(L, -2, n);
+      lua_rawseti(L, -3, i);
+      lua_pushnil(L);
+      lua_rawseti(L, -3, n);
+      return;
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/*
+ * Idle connection is readable: closed by peer or unexpected data.
+ * Arguments: evq_udata, ev_ludata, sd_udata, ...
+ */
+static int
+pool_watch_cb (lua_State *L)
+{
+  lua_settop(L, 3);
+  lua_getfenv(L, lua_upvalueindex(1));  /* env: 4 */
+
+  /* the oneshot event is deleted */
+  lua_rawgeti(L, 4, POOL_EVIDS);
+  lua_pushvalue(L, 3);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, 4, POOL_KEYS);
+  lua_pushvalue(L, 3);
+  lua_rawget(L, -2);  /* key */
+  if (!lua_isnil(L, -1)) {
+    lua_rawgeti(L, 4, POOL_IDLE);
+    lua_insert(L, -2);
+    lua_rawget(L, -2);  /* idle_list */
+    if (lua_istable(L, -1)) {
+      lua_pushvalue(L, 3);
+      pool_idle_remove(L);
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, 4);
+
+  lua_pushvalue(L, 3);
+  pool_drop(L, 4);
+  return 0;
+}
+
+/*
+ * Watch the idle connection on the event queue.
+ * Arguments: ..., env (table) at idx, sd_udata
+ */
+static void
+pool_watch (lua_State *L, const int env_idx)
+{
+  lua_rawgeti(L, env_idx, POOL_EVQ);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_getfield(L, -1, "add_socket");
+  lua_insert(L, -2);
+  lua_pushvalue(L, -3);  /* sd_udata */
+  lua_pushliteral(L, "r");
+  lua_pushvalue(L, 1);  /* pool_udata */
+  lua_pushcclosure(L, pool_watch_cb, 1);
+  lua_pushnil(L);  /* timeout */
+  lua_pushboolean(L, 1);  /* one_shot */
+  lua_call(L, 6, 1);
+
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_rawgeti(L, env_idx, POOL_EVIDS);
+  lua_pushvalue(L, -3);  /* sd_udata */
+  lua_pushvalue(L, -3);  /* ev_ludata */
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+
+/*
+ * Arguments: [max_connections (number), max_idle (number)]
+ * Returns: pool_udata
+ */
+static int
+pool_new (lua_State *L)
+{
+  const int max_conn = (int) luaL_optinteger(L, 1, POOL_MAX_CONN);
+  const int max_idle = (int) luaL_optinteger(L, 2, max_conn);
+  struct conn_pool *pool;
+  int i;
+
+  if (max_conn <= 0) luaL_argerror(L, 1, "positive number expected");
+
+  pool = lua_newuserdata(L, sizeof(struct conn_pool));
+  pool->max_conn = max_conn;
+  pool->max_idle = max_idle;
+  luaL_getmetatable(L, POOL_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, POOL_EVQ, 0);  /* environ. */
+  for (i = POOL_IDLE; i < POOL_EVQ; ++i) {
+    lua_newtable(L);
+    lua_rawseti(L, -2, i);
+  }
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+/*
+ * Arguments: pool_udata, sock_addr_udata
+ * Returns: [sd_udata, connecting (boolean) | false (limit reached)]
+ */
+static int
+pool_get (lua_State *L)
+{
+  struct conn_pool *pool = checkudata(L, 1, POOL_TYPENAME);
+  struct sock_addr *sap = checkudata(L, 2, SA_TYPENAME);
+  int nconn, connecting = 0;
+
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);  /* env: 3 */
+  lua_pushlstring(L, (char *) &sap->u, sap->addrlen);  /* key: 4 */
+
+  /* idle connections */
+  lua_rawgeti(L, 3, POOL_IDLE);
+  lua_pushvalue(L, 4);
+  lua_rawget(L, -2);  /* idle_list: 6 */
+  if (lua_istable(L, -1)) {
+    int n;
+
+    while ((n = (int) lua_rawlen(L, 6))) {
+      lua_rawgeti(L, 6, n);
+      lua_pushnil(L);
+      lua_rawseti(L, 6, n);
+
+      pool_unwatch(L, 3);
+      if (pool_alive((sd_t) lua_unboxinteger(L, -1, SD_TYPENAME)))
+        goto found;
+      pool_drop(L, 3);
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, 4);
+
+  /* new connection */
+  lua_rawgeti(L, 3, POOL_NCONN);
+  lua_pushvalue(L, 4);
+  lua_rawget(L, -2);
+  nconn = (int) lua_tointeger(L, -1);
+  lua_settop(L, 4);
+
+  if (nconn >= pool->max_conn) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  {
+    sd_t sd;
+    unsigned long opt = 1;
+    int res;
+
+#ifndef _WIN32
+    sd = socket(sap->u.addr.sa_family, SOCK_STREAM, 0);
+#else
+    sd = WSASocketW(sap->u.addr.sa_family, SOCK_STREAM, 0,
+     NULL, 0, WSA_FLAGS);
+#endif
+    if (sd == (sd_t) -1)
+      return sys_seterror(L, 0);
+
+    lua_boxinteger(L, sd);
+    luaL_getmetatable(L, SD_TYPENAME);
+    lua_setmetatable(L, -2);
+
+    if (ioctlsocket(sd, FIONBIO, &opt))
+      goto err;
+
+    sys_vm_leave(L);
+    do res = connect(sd, &sap->u.addr, sap->addrlen);
+#ifndef _WIN32
+    while (res == -1 && sys_eintr());
+#else
+    while (0);
+#endif
+    sys_vm_enter(L);
+
+    if (res == -1) {
+      if (!(SYS_IS_EAGAIN(SYS_ERRNO)
+#ifndef _WIN32
+       || SYS_ERRNO == EINPROGRESS
+#else
+       || SYS_ERRNO == WSAEINPROGRESS
+#endif
+      ))
+        goto err;
+      connecting = 1;
+    }
+  }
+
+  lua_rawgeti(L, 3, POOL_KEYS);
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, 4);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, 4);
+  pool_nconn_add(L, 3, 1);
+  lua_pop(L, 1);
+
+ found:
+  lua_rawgeti(L, 3, POOL_BUSY);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  lua_pushboolean(L, connecting);
+  return 2;
+ err:
+  {
+    const int err = SYS_ERRNO;
+
+    pool_close_sd(L);
+    return sys_seterror(L, err);
+  }
+}
+
+/*
+ * Arguments: pool_udata, sd_udata, [close (boolean)]
+ * Returns: pool_udata
+ */
+static int
+pool_put (lua_State *L)
+{
+  struct conn_pool *pool = checkudata(L, 1, POOL_TYPENAME);
+  sd_t sd = (sd_t) lua_unboxinteger(L, 2, SD_TYPENAME);
+  const int is_close = lua_toboolean(L, 3);
+
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);  /* env: 3 */
+
+  lua_rawgeti(L, 3, POOL_BUSY);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1))
+    luaL_argerror(L, 2, "connection is not from pool");
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  if (!is_close && sd != (sd_t) -1 && pool_alive(sd)) {
+    lua_rawgeti(L, 3, POOL_KEYS);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);  /* key: 5 */
+
+    lua_rawgeti(L, 3, POOL_IDLE);
+    lua_pushvalue(L, 5);
+    lua_rawget(L, -2);  /* idle_list: 7 */
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, 5);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, 6);
+    }
+    {
+      const int n = (int) lua_rawlen(L, 7);
+
+      if (n < pool->max_idle) {
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, 7, n + 1);
+
+        lua_settop(L, 3);
+        lua_pushvalue(L, 2);
+        pool_watch(L, 3);
+        lua_settop(L, 1);
+        return 1;
+      }
+    }
+    lua_settop(L, 3);
+  }
+  lua_pushvalue(L, 2);
+  pool_drop(L, 3);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+ * Arguments: pool_udata, [evq_udata]
+ * Returns: pool_udata
+ */
+static int
+pool_watch_evq (lua_State *L)
+{
+  (void) checkudata(L, 1, POOL_TYPENAME);
+
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);  /* env: 3 */
+
+  /* unwatch all idle connections */
+  lua_rawgeti(L, 3, POOL_EVIDS);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lua_pop(L, 1);
+    pool_unwatch(L, 3);
+    lua_pop(L, 1);
+    lua_pushnil(L);  /* table was changed: restart */
+  }
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, 3, POOL_EVQ);
+
+  /* watch all idle connections */
+  if (!lua_isnil(L, 2)) {
+    lua_rawgeti(L, 3, POOL_IDLE);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      const int n = (int) lua_rawlen(L, -1);
+      int i;
+
+      for (i = 1; i <= n; ++i) {
+        lua_rawgeti(L, -1, i);
+        pool_watch(L, 3);
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: number of closed connections
+ */
+static int
+pool_prune (lua_State *L)
+{
+  int nclosed = 0;
+
+  (void) checkudata(L, 1, POOL_TYPENAME);
+
+  lua_settop(L, 1);
+  lua_getfenv(L, 1);  /* env: 2 */
+
+  lua_rawgeti(L, 2, POOL_IDLE);
+  lua_pushnil(L);
+  while (lua_next(L, 3)) {
+    int i = (int) lua_rawlen(L, -1);
+
+    for (; i > 0; --i) {
+      lua_rawgeti(L, -1, i);
+      if (!pool_alive((sd_t) lua_unboxinteger(L, -1, SD_TYPENAME))) {
+        pool_unwatch(L, 2);
+        pool_idle_remove(L);
+        pool_drop(L, 2);
+        nclosed++;
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, nclosed);
+  return 1;
+}
+
+/*
+ * Arguments: pool_udata, [sock_addr_udata]
+ * Returns: number of connections, number of idle connections
+ */
+static int
+pool_count (lua_State *L)
+{
+  int nconn = 0, nidle = 0;
+
+  (void) checkudata(L, 1, POOL_TYPENAME);
+
+  lua_settop(L, 2);
+  lua_getfenv(L, 1);  /* env: 3 */
+
+  if (lua_isuserdata(L, 2)) {
+    struct sock_addr *sap = checkudata(L, 2, SA_TYPENAME);
+
+    lua_pushlstring(L, (char *) &sap->u, sap->addrlen);  /* key: 4 */
+    lua_rawgeti(L, 3, POOL_NCONN);
+    lua_pushvalue(L, 4);
+    lua_rawget(L, -2);
+    nconn = (int) lua_tointeger(L, -1);
+
+    lua_rawgeti(L, 3, POOL_IDLE);
+    lua_pushvalue(L, 4);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1))
+      nidle = (int) lua_rawlen(L, -1);
+  } else {
+    lua_rawgeti(L, 3, POOL_NCONN);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      nconn += (int) lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_rawgeti(L, 3, POOL_IDLE);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      nidle += (int) lua_rawlen(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushinteger(L, nconn);
+  lua_pushinteger(L, nidle);
+  return 2;
+}
+
+/*
+ * Arguments: pool_udata
+ */
+static int
+pool_close (lua_State *L)
+{
+  (void) checkudata(L, 1, POOL_TYPENAME);
+
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  pool_watch_evq(L);
+
+  lua_getfenv(L, 1);  /* env: 2 */
+  lua_rawgeti(L, 2, POOL_IDLE);
+  lua_pushnil(L);
+  while (lua_next(L, 3)) {
+    int i = (int) lua_rawlen(L, -1);
+
+    for (; i > 0; --i) {
+      lua_rawgeti(L, -1, i);
+      pool_drop(L, 2);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_newtable(L);
+  lua_rawseti(L, 2, POOL_IDLE);
+  return 0;
+}
+
+/*
+ * Arguments: pool_udata
+ * Returns: string
+ */
+static int
+pool_tostring (lua_State *L)
+{
+  struct conn_pool *pool = checkudata(L, 1, POOL_TYPENAME);
+
+  lua_pushfstring(L, POOL_TYPENAME " (%p)", pool);
+  return 1;
+}
+
+
+#define POOL_METHODS \
+  {"conn_pool",		pool_new}
+
+static luaL_Reg pool_meth[] = {
+  {"get",		pool_get},
+  {"put",		pool_put},
+  {"watch",		pool_watch_evq},
+  {"prune",		pool_prune},
+  {"count",		pool_count},
+  {"close",		pool_close},
+  {"__tostring",	pool_tostring},
+  {NULL, NULL}
+};
@@ -0,0 +1,458 @@
+/* Lua System: Networking: Asynchronous resolver */
+
+#if defined(USE_GAI) && !defined(_WIN32)
+
+#define USE_RESOLVER
+
+#define RESOLV_TYPENAME	"sys.sock.resolver"
+
+#define RESOLV_NTHREADS	2  /* default number of worker threads */
+#define RESOLV_TTL	60000  /* default cache time-to-live (milliseconds) */
+
+struct resolv_query {
+  struct resolv_query *next;
+  int id;
+  int nparts;  /* number of not completed lookups */
+  int gai_errno;  /* error of first failed lookup */
+  struct addrinfo *ai[2];  /* results of lookups */
+  char host[1];  /* variable size */
+};
+
+/* Lookup of one address family */
+struct resolv_job {
+  struct resolv_job *next;
+  struct resolv_query *query;
+  int family;
+  int part;
+};
+
+struct resolv {
+  pthread_mutex_t cs;
+  pthread_cond_t cond;
+
+  struct resolv_job *jobs, *jobs_tail;  /* queue of lookups */
+  struct resolv_query *done;  /* completed queries */
+
+  fd_t fd[2];  /* pipe: readable when queries completed */
+
+  unsigned int stop:	1;  /* resolver is closed */
+
+  int nthreads;
+  pthread_t tids[1];  /* variable size: worker threads */
+};
+
+/* Userdata: descriptor first to use it in the event queue */
+struct resolv_udata {
+  fd_t fd;
+  int next_id;
+  msec_t ttl;
+  struct resolv *rs;
+};
+
+
+static void
+resolv_query_free (struct resolv_query *query)
+{
+  if (query->ai[0]) freeaddrinfo(query->ai[0]);
+  if (query->ai[1]) freeaddrinfo(query->ai[1]);
+  free(query);
+}
+
+/*
+ * Free the resolver, its worker threads are joined.
+ */
+static void
+resolv_free (struct resolv *rs)
+{
+  while (rs->jobs) {
+    struct resolv_job *job = rs->jobs;
+
+    rs->jobs = job->next;
+    if (!--job->query->nparts)
+      resolv_query_free(job->query);
+    free(job);
+  }
+  while (rs->done) {
+    struct resolv_query *query = rs->done;
+
+    rs->done = query->next;
+    resolv_query_free(query);
+  }
+  close(rs->fd[0]);
+  close(rs->fd[1]);
+  pthread_cond_destroy(&rs->cond);
+  pthread_mutex_destroy(&rs->cs);
+  free(rs);
+}
+
+static void *
+resolv_worker (void *arg)
+{
+  struct resolv *rs = arg;
+
+  pthread_mutex_lock(&rs->cs);
+  for (; ; ) {
+    struct resolv_job *job = rs->jobs;
+    struct resolv_query *query;
+    struct addrinfo hints, *result = NULL;
+    int gai_errno;
+
+    if (rs->stop) break;
+    if (!job) {
+      pthread_cond_wait(&rs->cond, &rs->cs);
+      continue;
+    }
+    rs->jobs = job->next;
+    if (!rs->jobs) rs->jobs_tail = NULL;
+    pthread_mutex_unlock(&rs->cs);
+
+    query = job->query;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = job->family;
+    hints.ai_socktype = SOCK_STREAM;  /* one entry per address */
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    gai_errno = getaddrinfo(query->host, NULL, &hints, &result);
+
+    pthread_mutex_lock(&rs->cs);
+    if (gai_errno) {
+      if (!query->gai_errno) query->gai_errno = gai_errno;
+    } else {
+      query->ai[job->part] = result;
+    }
+    free(job);
+
+    if (!--query->nparts) {
+      if (rs->stop)
+        resolv_query_free(query);
+      else {
+        if (!rs->done) {
+          int nw;
+          do nw = write(rs->fd[1], "", 1);
+          while (nw == -1 && sys_eintr());
+        }
+        query->next = rs->done;
+        rs->done = query;
+      }
+    }
+  }
+  pthread_mutex_unlock(&rs->cs);
+  return NULL;
+}
+
+
+/*
+ * Arguments: [num_threads (number), ttl (milliseconds)]
+ * Returns: [resolver_udata]
+ */
+static int
+resolv_new (lua_State *L)
+{
+  const int nthreads = (int) luaL_optinteger(L, 1, RESOLV_NTHREADS);
+  const msec_t ttl = (msec_t) luaL_optinteger(L, 2, RESOLV_TTL);
+  struct resolv_udata *rsu;
+  struct resolv *rs;
+  int i;
+
+  if (nthreads <= 0) luaL_argerror(L, 1, "positive number expected");
+
+  rsu = lua_newuserdata(L, sizeof(struct resolv_udata));
+  memset(rsu, 0, sizeof(struct resolv_udata));
+  rsu->fd = (fd_t) -1;
+  rsu->ttl = ttl;
+  luaL_getmetatable(L, RESOLV_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  lua_newtable(L);  /* cache & pending queries */
+  lua_setfenv(L, -2);
+
+  rs = calloc(1, sizeof(struct resolv)
+   + (nthreads - 1) * sizeof(pthread_t));
+  if (!rs) goto err;
+
+  if (pipe(rs->fd)) {
+    free(rs);
+    goto err;
+  }
+  fcntl(rs->fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(rs->fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(rs->fd[1], F_SETFD, FD_CLOEXEC);
+
+  pthread_mutex_init(&rs->cs, NULL);
+  pthread_cond_init(&rs->cond, NULL);
+
+  rsu->rs = rs;
+  rsu->fd = rs->fd[0];
+
+  for (i = 0; i < nthreads; ++i) {
+    const int res = pthread_create(&rs->tids[i], NULL, resolv_worker, rs);
+
+    if (!res) rs->nthreads++;
+    else {
+      if (i) break;  /* at least one worker */
+      errno = res;
+      goto err;
+    }
+  }
+  return 1;
+ err:
+  return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: resolver_udata
+ *
+ * Closes the pipe's read end, the resolver's descriptor: delete its
+ * event from the event queue before, else the queue keeps polling
+ * a closed (maybe reused) descriptor number.
+ *
+ * Waits for worker threads to finish their current lookups.
+ */
+static int
+resolv_close (lua_State *L)
+{
+  struct resolv_udata *rsu = checkudata(L, 1, RESOLV_TYPENAME);
+  struct resolv *rs = rsu->rs;
+
+  if (rs) {
+    int i;
+
+    pthread_mutex_lock(&rs->cs);
+    rs->stop = 1;
+    pthread_cond_broadcast(&rs->cond);
+    pthread_mutex_unlock(&rs->cs);
+
+    sys_vm_leave(L);
+    for (i = 0; i < rs->nthreads; ++i)
+      pthread_join(rs->tids[i], NULL);
+    sys_vm_enter(L);
+
+    resolv_free(rs);
+    rsu->rs = NULL;
+    rsu->fd = (fd_t) -1;
+  }
+  return 0;
+}
+
+/*
+ * Arguments: resolver_udata, host_name (string),
+ *	[family (string: "any", "inet", "inet6")]
+ * Returns: [binary_addresses (table) | query_id (number)]
+ *
+ * Concurrent resolves of the same host and family share one query_id.
+ */
+static int
+resolv_resolve (lua_State *L)
+{
+  static const int af_flags[] = {AF_UNSPEC, AF_INET, AF_INET6};
+  static const char *const af_names[] = {"any", "inet", "inet6", NULL};
+
+  struct resolv_udata *rsu = checkudata(L, 1, RESOLV_TYPENAME);
+  struct resolv *rs = rsu->rs;
+  size_t host_len;
+  const char *host = luaL_checklstring(L, 2, &host_len);
+  const int af_idx = luaL_checkoption(L, 3, "any", af_names);
+  const int nparts = (af_idx == 0) ? 2 : 1;
+  struct resolv_query *query;
+  struct resolv_job *jobs[2];
+  int i;
+
+  if (!rs) luaL_argerror(L, 1, "closed");
+
+  lua_settop(L, 3);
+  lua_getfenv(L, 1);
+
+  /* lookup the cache */
+  lua_pushfstring(L, "%s/%s", host, af_names[af_idx]);  /* cache key */
+  lua_pushvalue(L, -1);
+  lua_rawget(L, 4);
+  if (lua_istable(L, -1)) {
+    msec_t expire;
+
+    lua_rawgeti(L, -1, 1);
+    expire = (msec_t) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (expire - sys_milliseconds() > 0) {
+      lua_rawgeti(L, -1, 2);  /* binary_addresses */
+      return 1;
+    }
+  } else if (lua_isnumber(L, -1)) {
+    return 1;  /* pending query_id */
+  }
+  lua_pop(L, 1);
+
+  query = calloc(1, sizeof(struct resolv_query) + host_len);
+  jobs[0] = malloc(sizeof(struct resolv_job));
+  jobs[1] = (nparts == 2) ? malloc(sizeof(struct resolv_job)) : NULL;
+  if (!query || !jobs[0] || (nparts == 2 && !jobs[1])) {
+    free(query);
+    free(jobs[0]);
+    free(jobs[1]);
+    return sys_seterror(L, ENOMEM);
+  }
+
+  query->id = ++rsu->next_id;
+  query->nparts = nparts;
+  memcpy(query->host, host, host_len + 1);
+
+  for (i = 0; i < nparts; ++i) {
+    struct resolv_job *job = jobs[i];
+
+    job->next = (i + 1 < nparts) ? jobs[i + 1] : NULL;
+    job->query = query;
+    job->part = i;
+    job->family = (nparts == 2) ? (i ? AF_INET6 : AF_INET)
+     : af_flags[af_idx];
+  }
+
+  /* pending query: cache key -> id -> cache key */
+  lua_pushvalue(L, 5);
+  lua_pushinteger(L, query->id);
+  lua_rawset(L, 4);
+  lua_rawseti(L, 4, query->id);
+
+  pthread_mutex_lock(&rs->cs);
+  if (rs->jobs_tail)
+    rs->jobs_tail->next = jobs[0];
+  else
+    rs->jobs = jobs[0];
+  rs->jobs_tail = jobs[nparts - 1];
+  pthread_cond_broadcast(&rs->cond);
+  pthread_mutex_unlock(&rs->cs);
+
+  lua_pushinteger(L, query->id);
+  return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: answers (table: {query_id = binary_addresses (table)
+ *	| error_message (string)})
+ */
+static int
+resolv_results (lua_State *L)
+{
+  struct resolv_udata *rsu = checkudata(L, 1, RESOLV_TYPENAME);
+  struct resolv *rs = rsu->rs;
+  struct resolv_query *query;
+  const msec_t expire = sys_milliseconds() + rsu->ttl;
+
+  if (!rs) luaL_argerror(L, 1, "closed");
+
+  pthread_mutex_lock(&rs->cs);
+  query = rs->done;
+  rs->done = NULL;
+  {
+    char buf[64];
+    while (read(rs->fd[0], buf, sizeof(buf)) > 0)
+      continue;
+  }
+  pthread_mutex_unlock(&rs->cs);
+
+  lua_settop(L, 1);
+  lua_getfenv(L, 1);
+  lua_newtable(L);
+
+  while (query) {
+    struct resolv_query *next = query->next;
+
+    if (query->ai[0] || query->ai[1]) {
+      int i, n = 0;
+
+      lua_newtable(L);  /* binary_addresses */
+      for (i = 0; i < 2; ++i) {
+        struct addrinfo *rp = query->ai[i];
+
+        for (; rp; rp = rp->ai_next) {
+          sock_pushaddr(L, (struct sock_addr *) rp->ai_addr);
+          lua_rawseti(L, -2, ++n);
+        }
+      }
+
+      /* cache the answer */
+      lua_rawgeti(L, 2, query->id);  /* cache key */
+      lua_createtable(L, 2, 0);
+      lua_pushinteger(L, expire);
+      lua_rawseti(L, -2, 1);
+      lua_pushvalue(L, -3);
+      lua_rawseti(L, -2, 2);
+      lua_rawset(L, 2);
+    } else {
+      lua_rawgeti(L, 2, query->id);  /* cache key */
+      lua_pushvalue(L, -1);
+      lua_rawget(L, 2);
+      if (lua_tointeger(L, -1) == query->id) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, 2);  /* not pending anymore */
+      } else
+        lua_pop(L, 2);
+
+      lua_pushstring(L, gai_strerror(query->gai_errno));
+    }
+    lua_rawseti(L, 3, query->id);
+
+    /* remove from pending */
+    lua_pushnil(L);
+    lua_rawseti(L, 2, query->id);
+
+    resolv_query_free(query);
+    query = next;
+  }
+  return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: resolver_udata
+ */
+static int
+resolv_flush (lua_State *L)
+{
+  (void) checkudata(L, 1, RESOLV_TYPENAME);
+
+  lua_settop(L, 1);
+  lua_getfenv(L, 1);
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, 2);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+ * Arguments: resolver_udata
+ * Returns: string
+ */
+static int
+resolv_tostring (lua_State *L)
+{
+  struct resolv_udata *rsu = checkudata(L, 1, RESOLV_TYPENAME);
+
+  lua_pushfstring(L, RESOLV_TYPENAME " (%p)", rsu->rs);
+  return 1;
+}
+
+
+#define RESOLV_METHODS \
+  {"resolver",		resolv_new}
+
+static luaL_Reg resolv_meth[] = {
+  {"resolve",		resolv_resolve},
+  {"results",		resolv_results},
+  {"flush",		resolv_flush},
+  {"close",		resolv_close},
+  {"__tostring",	resolv_tostring},
+  {"__gc",		resolv_close},
+  {NULL, NULL}
+};
+
+#endif
@@ -27,10 +27,16 @@ typedef int		socklen_t;
 #include <netinet/tcp.h>	/* TCP_NODELAY */
 #include <netdb.h>
 
+#include <sys/uio.h>		/* writev, sendfile */
+#include <poll.h>		/* accept_many */
 #if defined(__linux__)
 #include <sys/sendfile.h>
-#else
-#include <sys/uio.h>		/* sendfile */
+#include <linux/errqueue.h>	/* MSG_ZEROCOPY completions */
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+#include <linux/tls.h>		/* kTLS */
+#define USE_KTLS
+#endif
 #endif
 
 #ifdef __sun
@@ -51,10 +57,20 @@ typedef int		socklen_t;
 #define MSG_FASTOPEN	0x20000000
 #endif
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT	103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO		104
+#endif
+
 
 #define SD_TYPENAME	"sys.sock.handle"
 
 #include "sock_addr.c"
+#include "sock_resolv.c"
+#include "sock_pool.c"
 
 
 /*
@@ -276,7 +292,9 @@ sock_sockopt (lua_State *L)
     TCP_NODELAY, TCP_FASTOPEN,
 #define OPT_INDEX_IP	14
     IP_MULTICAST_TTL, IP_MULTICAST_IF, IP_MULTICAST_LOOP,
-    IP_HDRINCL
+    IP_HDRINCL,
+#define OPT_INDEX_UDP	18
+    UDP_SEGMENT, UDP_GRO
   };
   static const char *const opt_names[] = {
     "reuseaddr", "type", "error", "dontroute",
@@ -284,13 +302,15 @@ sock_sockopt (lua_State *L)
     "broadcast", "keepalive", "oobinline", "linger",
     "tcp_nodelay", "tcp_fastopen",
     "multicast_ttl", "multicast_if", "multicast_loop",
-    "hdrincl", NULL
+    "hdrincl",
+    "udp_segment", "udp_gro", NULL
   };
 
   sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
   const int optname = luaL_checkoption(L, OPT_START, NULL, opt_names);
   const int level = (optname < OPT_INDEX_TCP) ? SOL_SOCKET
-   : (optname < OPT_INDEX_IP ? IPPROTO_TCP : IPPROTO_IP);
+   : (optname < OPT_INDEX_IP) ? IPPROTO_TCP
+   : (optname < OPT_INDEX_UDP ? IPPROTO_IP : IPPROTO_UDP);
   int optflag = opt_flags[optname];
   int optval[4];
   socklen_t optlen = sizeof(int);
@@ -350,6 +370,7 @@ sock_sockopt (lua_State *L)
 }
 #undef OPT_INDEX_TCP
 #undef OPT_INDEX_IP
+#undef OPT_INDEX_UDP
 #undef OPT_START
 
 /*
@@ -502,6 +523,160 @@ sock_accept (lua_State *L)
   return sys_seterror(L, 0);
 }
 
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+#define USE_ACCEPT4
+#endif
+
+#define SOCK_ACCEPT_MAX	64  /* maximum connections per call */
+
+/*
+ * Arguments: ..., options (table)
+ */
+static int
+sock_optboolean (lua_State *L, const char *field, const int def)
+{
+  int res = def;
+
+  lua_getfield(L, -1, field);
+  if (!lua_isnil(L, -1))
+    res = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+/*
+ * Returns: non-zero, when the listening socket has pending connections
+ */
+static int
+sock_accept_ready (sd_t sd)
+{
+#ifndef _WIN32
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  do res = poll(&pfd, 1, 0);
+  while (res == -1 && sys_eintr());
+  return res > 0;
+#else
+  struct timeval tv;
+  fd_set rset;
+
+  tv.tv_sec = tv.tv_usec = 0;
+  FD_ZERO(&rset);
+  FD_SET(sd, &rset);
+  return select(0, &rset, NULL, NULL, &tv) > 0;
+#endif
+}
+
+/*
+ * Arguments: sd_udata, [max_count (number), options (table: {
+ *	nonblocking (boolean: true), cloexec (boolean: true),
+ *	peers (boolean: false)})]
+ * Returns: [sockets (table: {sd_udata ...}),
+ *	peers (table: {sock_addr_udata ...}) | false (EAGAIN)]
+ */
+static int
+sock_accept_many (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  int max = (int) luaL_optinteger(L, 2, SOCK_ACCEPT_MAX);
+  int nonblocking = 1, cloexec = 1, peers = 0;
+  int is_blocking = 1;  /* listening socket's mode is unknown on Windows */
+  struct sock_addr addrs[SOCK_ACCEPT_MAX];
+  sd_t sds[SOCK_ACCEPT_MAX];
+  int i, n = 0;
+
+  if (max <= 0) luaL_argerror(L, 2, "positive number expected");
+  if (max > SOCK_ACCEPT_MAX) max = SOCK_ACCEPT_MAX;
+
+  if (lua_istable(L, 3)) {
+    lua_settop(L, 3);
+    nonblocking = sock_optboolean(L, "nonblocking", 1);
+    cloexec = sock_optboolean(L, "cloexec", 1);
+    peers = sock_optboolean(L, "peers", 0);
+  }
+#ifdef _WIN32
+  (void) cloexec;
+#endif
+
+#ifndef _WIN32
+  {
+    const int flags = fcntl(sd, F_GETFL);
+
+    is_blocking = (flags != -1 && !(flags & O_NONBLOCK));
+  }
+#endif
+
+  sys_vm_leave(L);
+  for (; n < max; ++n) {
+    struct sockaddr *sap = NULL;
+    socklen_t *slp = NULL;
+    sd_t nsd;
+
+    /* don't block, when some connections are already accepted */
+    if (n && is_blocking && !sock_accept_ready(sd))
+      break;
+
+    if (peers) {
+      sap = &addrs[n].u.addr;
+      slp = &addrs[n].addrlen;
+      *slp = SOCK_ADDR_LEN;
+    }
+#if defined(USE_ACCEPT4)
+    do nsd = accept4(sd, sap, slp, (nonblocking ? SOCK_NONBLOCK : 0)
+     | (cloexec ? SOCK_CLOEXEC : 0));
+    while (nsd == -1 && sys_eintr());
+#elif !defined(_WIN32)
+    do nsd = accept(sd, sap, slp);
+    while (nsd == -1 && sys_eintr());
+    if (nsd != -1 && cloexec)
+      (void) fcntl(nsd, F_SETFD, FD_CLOEXEC);
+#else
+    nsd = accept(sd, sap, slp);
+#endif
+    if (nsd == (sd_t) -1) break;
+#ifndef USE_ACCEPT4
+    if (nonblocking) {
+      unsigned long opt = 1;
+      (void) ioctlsocket(nsd, FIONBIO, &opt);
+    }
+#endif
+    sds[n] = nsd;
+  }
+  sys_vm_enter(L);
+
+  if (!n) {
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; ++i) {
+    lua_boxinteger(L, sds[i]);
+    luaL_getmetatable(L, SD_TYPENAME);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, i + 1);
+  }
+  if (!peers) return 1;
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; ++i) {
+    struct sock_addr *sap = lua_newuserdata(L, sizeof(struct sock_addr));
+
+    memcpy(sap, &addrs[i], sizeof(struct sock_addr));
+    luaL_getmetatable(L, SA_TYPENAME);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 2;
+}
+
 /*
  * Arguments: sd_udata, sock_addr_udata
  * Returns: [sd_udata | false (EINPROGRESS)]
@@ -637,14 +812,14 @@ sock_recv (lua_State *L)
   }
   do {
     rlen = (n <= sb.size) ? n : sb.size;
-    if (td) sys_vm2_leave(td);
+    sys_vm_leave(L);
 #ifndef _WIN32
     do nr = recvfrom(sd, sb.ptr.w, rlen, flags, sap, slp);
     while (nr == -1 && sys_eintr());
 #else
     nr = recvfrom(sd, sb.ptr.w, (int) rlen, flags, sap, slp);
 #endif
-    if (td) sys_vm2_enter(td);
+    sys_vm_enter(L);
     if (nr == -1) break;
     n -= nr;  /* still have to read 'n' bytes */
   } while ((n != 0L && nr == (int) rlen)  /* until end of count or eof */
@@ -664,6 +839,980 @@ sock_recv (lua_State *L)
 }
 
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+
+#define USE_MMSG
+
+#define SOCK_MMSG_MAX	64  /* maximum messages per system call */
+#define SOCK_DGRAM_MAX	65535  /* maximum datagram payload */
+
+/*
+ * Arguments: sd_udata, membuf_udata, max_count (number),
+ *	max_size (number), offsets (table),
+ *	[from (table: {1..max_count: sock_addr_udata})]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Payloads are appended to the membuf contiguously;
+ * offsets[i] .. offsets[i + 1] - 1 are the bounds of i-th payload.
+ */
+static int
+sock_recv_many (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  int count = (int) luaL_checkinteger(L, 3);
+  const lua_Integer max_size = luaL_checkinteger(L, 4);
+  const int has_from = lua_istable(L, 6);
+  struct sock_addr *from[SOCK_MMSG_MAX];
+  struct mmsghdr msgs[SOCK_MMSG_MAX];
+  struct iovec iov[SOCK_MMSG_MAX];
+  struct sys_thread *td = sys_thread_get();
+  struct sys_buffer sb, rb;
+  size_t off, pos;
+  int i, nr;
+
+  if (count <= 0) luaL_argerror(L, 3, "positive number expected");
+  if (count > SOCK_MMSG_MAX) count = SOCK_MMSG_MAX;
+  if (max_size <= 0 || max_size > SOCK_DGRAM_MAX)
+    luaL_argerror(L, 4, "invalid size");
+  luaL_checktype(L, 5, LUA_TTABLE);
+
+  /* reserve space for packets */
+  sys_buffer_write_init(L, 2, &sb, NULL, 0);
+  if (sb.size < (size_t) (count * max_size)
+   && !sys_buffer_write_next(L, &sb, NULL, (size_t) (count * max_size)))
+    return sys_seterror(L, ENOMEM);
+  sys_buffer_read_init(L, 2, &rb);
+  off = rb.size;  /* start of the packets */
+
+  memset(msgs, 0, count * sizeof(struct mmsghdr));
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = sb.ptr.w + i * max_size;
+    iov[i].iov_len = (size_t) max_size;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+
+    if (has_from) {
+      lua_rawgeti(L, 6, i + 1);
+      if (!lua_isnil(L, -1))
+        from[i] = checkudata(L, -1, SA_TYPENAME);
+      else {
+        lua_pop(L, 1);
+        from[i] = lua_newuserdata(L, sizeof(struct sock_addr));
+        luaL_getmetatable(L, SA_TYPENAME);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 6, i + 1);
+      }
+      lua_pop(L, 1);
+      msgs[i].msg_hdr.msg_name = &from[i]->u.addr;
+      msgs[i].msg_hdr.msg_namelen = SOCK_ADDR_LEN;
+    }
+  }
+
+  sys_vm_leave(L);
+  do nr = recvmmsg(sd, msgs, count, MSG_WAITFORONE, NULL);
+  while (nr == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nr == -1) {
+    if (td) sys_thread_check(td, L);
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  /* compact the payloads */
+  for (pos = 0, i = 0; i < nr; ++i) {
+    const size_t len = msgs[i].msg_len;
+    const char *p = iov[i].iov_base;
+
+    if (p != sb.ptr.w + pos)
+      memmove(sb.ptr.w + pos, p, len);
+
+    lua_pushinteger(L, off + pos);
+    lua_rawseti(L, 5, i + 1);
+    pos += len;
+
+    if (has_from)
+      from[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+  }
+  lua_pushinteger(L, off + pos);
+  lua_rawseti(L, 5, nr + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, 5, nr + 2);
+
+  sys_buffer_write_done(L, &sb, NULL, pos);
+  if (td) sys_thread_check(td, L);
+  lua_pushinteger(L, nr);
+  return 1;
+}
+
+/*
+ * Arguments: sd_udata, {string | membuf_udata},
+ *	offsets (table: {1..count+1: number}),
+ *	[to (sock_addr_udata | table: {1..count: sock_addr_udata})]
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_send_many (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  const int to_table = lua_istable(L, 4);
+  struct sock_addr *to = (to_table || lua_isnoneornil(L, 4)) ? NULL
+   : checkudata(L, 4, SA_TYPENAME);
+  struct sys_buffer sb;
+  int n, count, nw = 0;
+
+  if (!sys_buffer_read_init(L, 2, &sb))
+    luaL_argerror(L, 2, "buffer expected");
+  luaL_checktype(L, 3, LUA_TTABLE);
+  count = (int) lua_rawlen(L, 3) - 1;
+  if (count < 0) count = 0;
+
+  for (n = 0; n < count; ) {
+    struct mmsghdr msgs[SOCK_MMSG_MAX];
+    struct iovec iov[SOCK_MMSG_MAX];
+    size_t off;
+    int k, res;
+
+    const int nmsg = (count - n < SOCK_MMSG_MAX)
+     ? count - n : SOCK_MMSG_MAX;
+
+    memset(msgs, 0, nmsg * sizeof(struct mmsghdr));
+
+    lua_rawgeti(L, 3, n + 1);
+    off = (size_t) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    for (k = 0; k < nmsg; ++k) {
+      struct sock_addr *sap = to;
+      size_t end;
+
+      lua_rawgeti(L, 3, n + k + 2);
+      end = (size_t) lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      if (end < off || end > sb.size)
+        luaL_argerror(L, 3, "invalid offsets");
+
+      iov[k].iov_base = sb.ptr.w + off;
+      iov[k].iov_len = end - off;
+      msgs[k].msg_hdr.msg_iov = &iov[k];
+      msgs[k].msg_hdr.msg_iovlen = 1;
+      off = end;
+
+      if (to_table) {
+        lua_rawgeti(L, 4, n + k + 1);
+        sap = checkudata(L, -1, SA_TYPENAME);
+        lua_pop(L, 1);
+      }
+      if (sap) {
+        msgs[k].msg_hdr.msg_name = &sap->u.addr;
+        msgs[k].msg_hdr.msg_namelen = sap->addrlen;
+      }
+    }
+
+    sys_vm_leave(L);
+    do res = sendmmsg(sd, msgs, nmsg, 0);
+    while (res == -1 && sys_eintr());
+    sys_vm_enter(L);
+
+    if (res == -1) {
+      if (nw > 0 || SYS_IS_EAGAIN(SYS_ERRNO))
+        break;
+      return sys_seterror(L, 0);
+    }
+    nw += res;
+    n += res;
+    if (res < nmsg) break;
+  }
+  if (nw || !count)
+    lua_pushinteger(L, nw);
+  else
+    lua_pushboolean(L, 0);
+  return 1;
+}
+
+#endif
+
+
+#if defined(__linux__)
+
+#define USE_UDP_GSO
+
+#define SOCK_GRO_MAX	65535  /* maximum coalesced datagram size */
+
+/*
+ * Arguments: sd_udata, {string | membuf_udata}, segment_size (number),
+ *	[to (sock_addr_udata)]
+ * Returns: [count (number) | false (EAGAIN)]
+ */
+static int
+sock_send_gso (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  const int seg_size = (int) luaL_checkinteger(L, 3);
+  struct sock_addr *to = lua_isnoneornil(L, 4) ? NULL
+   : checkudata(L, 4, SA_TYPENAME);
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  struct sys_buffer sb;
+  struct msghdr msg;
+  struct iovec iov;
+  uint16_t gso_size;
+  int nw;
+
+  if (!sys_buffer_read_init(L, 2, &sb))
+    luaL_argerror(L, 2, "buffer expected");
+  if (seg_size <= 0 || seg_size > 0xFFFF)
+    luaL_argerror(L, 3, "invalid segment size");
+
+  iov.iov_base = sb.ptr.w;
+  iov.iov_len = sb.size;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (to) {
+    msg.msg_name = &to->u.addr;
+    msg.msg_namelen = to->addrlen;
+  }
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  gso_size = (uint16_t) seg_size;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+
+  sys_vm_leave(L);
+  do nw = sendmsg(sd, &msg, 0);
+  while (nw == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nw == -1) {
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  sys_buffer_read_next(&sb, nw);
+  lua_pushinteger(L, nw);
+  return 1;
+}
+
+/*
+ * Arguments: sd_udata, membuf_udata, offsets (table),
+ *	[from (sock_addr_udata)]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Coalesced datagram is appended to the membuf;
+ * offsets[i] .. offsets[i + 1] - 1 are the bounds of i-th segment.
+ */
+static int
+sock_recv_gro (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  struct sock_addr *from = lua_isnoneornil(L, 4) ? NULL
+   : checkudata(L, 4, SA_TYPENAME);
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct cmsghdr *cmsg;
+  struct sys_thread *td = sys_thread_get();
+  struct sys_buffer sb, rb;
+  struct msghdr msg;
+  struct iovec iov;
+  size_t off, pos, seg_size;
+  int i, nr;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  /* reserve space for datagram */
+  sys_buffer_write_init(L, 2, &sb, NULL, 0);
+  if (sb.size < SOCK_GRO_MAX
+   && !sys_buffer_write_next(L, &sb, NULL, SOCK_GRO_MAX))
+    return sys_seterror(L, ENOMEM);
+  sys_buffer_read_init(L, 2, &rb);
+  off = rb.size;  /* start of the datagram */
+
+  iov.iov_base = sb.ptr.w;
+  iov.iov_len = SOCK_GRO_MAX;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (from) {
+    msg.msg_name = &from->u.addr;
+    msg.msg_namelen = SOCK_ADDR_LEN;
+  }
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  sys_vm_leave(L);
+  do nr = recvmsg(sd, &msg, 0);
+  while (nr == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nr == -1) {
+    if (td) sys_thread_check(td, L);
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  if (from)
+    from->addrlen = msg.msg_namelen;
+
+  /* segment size */
+  seg_size = nr;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int gso_size;
+
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+      if (gso_size > 0) seg_size = gso_size;
+      break;
+    }
+  }
+
+  /* segment boundaries */
+  i = 0;
+  pos = 0;
+  do {
+    lua_pushinteger(L, off + pos);
+    lua_rawseti(L, 3, ++i);
+    pos += seg_size;
+  } while (pos < (size_t) nr);
+  lua_pushinteger(L, off + nr);
+  lua_rawseti(L, 3, i + 1);
+  lua_pushnil(L);
+  lua_rawseti(L, 3, i + 2);
+
+  sys_buffer_write_done(L, &sb, NULL, nr);
+  if (td) sys_thread_check(td, L);
+  lua_pushinteger(L, i);
+  return 1;
+}
+
+#endif
+
+
+#if defined(__linux__)
+
+#define USE_ZEROCOPY
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+#define SD_ZC_PINS	"sys.sock.zc_pins"
+
+/*
+ * Get the table of buffers pinned until completion of zerocopy sends.
+ * Arguments: sd_udata, ...
+ * Returns: 0 (not found), 1 (found), 2 (created); [pins (table)]
+ */
+static int
+sock_zc_pins (lua_State *L, const int create)
+{
+  int res = 1;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, SD_ZC_PINS);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (!create) return 0;
+
+    lua_newtable(L);  /* sockets with pins (weak keys) */
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, SD_ZC_PINS);
+  }
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (!create) {
+      lua_pop(L, 1);
+      return 0;
+    }
+
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    res = 2;
+  }
+  lua_remove(L, -2);
+  return res;
+}
+
+/*
+ * Arguments: sd_udata, {string | membuf_udata}, [to (sock_addr_udata)]
+ * Returns: [count (number), send_id (number) | false (EAGAIN)]
+ *
+ * The buffer is pinned (must not be changed) until completion of the send.
+ */
+static int
+sock_send_zc (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  struct sock_addr *to = lua_isnoneornil(L, 3) ? NULL
+   : checkudata(L, 3, SA_TYPENAME);
+  struct sys_buffer sb;
+  unsigned int send_id;
+  int nw;
+
+  if (!sys_buffer_read_init(L, 2, &sb))
+    luaL_argerror(L, 2, "buffer expected");
+  lua_settop(L, 3);  /* keep "to" referenced while VM is left */
+
+  if (sock_zc_pins(L, 1) == 2) {
+    const int optval = 1;
+
+    if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(int)))
+      return sys_seterror(L, 0);
+  }
+
+  sys_vm_leave(L);
+  do nw = !to ? send(sd, sb.ptr.r, sb.size, MSG_ZEROCOPY)
+   : sendto(sd, sb.ptr.r, sb.size, MSG_ZEROCOPY,
+    &to->u.addr, to->addrlen);
+  while (nw == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nw == -1) {
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+
+  /* pin the buffer; kernel numbers the sends sequentially */
+  lua_getfield(L, 4, "id");
+  {
+    const lua_Number id = lua_tonumber(L, -1);
+    send_id = (unsigned int) id;
+  }
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, 4, (int) send_id);
+  lua_pushnumber(L, (lua_Number) (send_id + 1));
+  lua_setfield(L, 4, "id");
+
+  lua_pushinteger(L, nw);
+  lua_pushnumber(L, (lua_Number) send_id);
+  return 2;
+}
+
+/*
+ * Arguments: sd_udata
+ * Returns: [count (number), copied (boolean) | false (EAGAIN)]
+ *
+ * Read the completions of zerocopy sends and unpin their buffers.
+ */
+static int
+sock_zc_complete (lua_State *L)
+{
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  unsigned int count = 0;
+  int copied = 0, has_pins;
+
+  lua_settop(L, 1);
+  has_pins = sock_zc_pins(L, 0);
+
+  for (; ; ) {
+    union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(struct sock_extended_err)
+       + sizeof(struct sockaddr_in6))];
+    } ctl;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    int res;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do res = recvmsg(sd, &msg, MSG_ERRQUEUE);
+    while (res == -1 && sys_eintr());
+
+    if (res == -1) {
+      if (count) break;
+      if (!SYS_IS_EAGAIN(SYS_ERRNO))
+        return sys_seterror(L, 0);
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err serr;
+      unsigned int id;
+
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+       || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+        continue;
+
+      memcpy(&serr, CMSG_DATA(cmsg), sizeof(struct sock_extended_err));
+      if (serr.ee_errno || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        copied = 1;
+
+      /* unpin the range of sends */
+      id = serr.ee_info;
+      do {
+        if (has_pins) {
+          lua_pushnil(L);
+          lua_rawseti(L, 2, (int) id);
+        }
+        count++;
+      } while (id++ != serr.ee_data);
+    }
+  }
+  lua_pushnumber(L, (lua_Number) count);
+  lua_pushboolean(L, copied);
+  return 2;
+}
+
+#endif
+
+
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+
+#define USE_SPLICE
+
+#define SPLICE_TYPENAME	"sys.sock.splice_pipe"
+#define SD_SPLICE_PIPES	"sys.sock.splice_pipes"
+
+#define SPLICE_CHUNK	(64 * 1024)  /* default maximum bytes per call */
+#define SPLICE_POOL_MAX	16  /* maximum idle pipes to keep */
+
+/* Pipe to move data kernel-side from socket to other descriptor */
+struct splice_pipe {
+  int fd[2];
+  size_t pending;  /* bytes in pipe not yet moved to destination */
+};
+
+/*
+ * Returns: descriptor of sd_udata or fd_udata
+ */
+static int
+sock_splice_fd (lua_State *L, const int idx)
+{
+  const fd_t *fdp = lua_touserdata(L, idx);
+  int is_handle = 0;
+
+  if (fdp && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, SD_TYPENAME);
+    luaL_getmetatable(L, FD_TYPENAME);
+    is_handle = lua_rawequal(L, -3, -2) || lua_rawequal(L, -3, -1);
+    lua_pop(L, 3);
+  }
+  if (!is_handle || *fdp == (fd_t) -1)
+    luaL_argerror(L, idx, "handle expected");
+  return *fdp;
+}
+
+/*
+ * Arguments: ..., options (string) ...
+ */
+static unsigned int
+sock_splice_flags (lua_State *L, int idx)
+{
+  static const unsigned int o_flags[] = {
+    SPLICE_F_MOVE, SPLICE_F_NONBLOCK, SPLICE_F_MORE
+  };
+  static const char *const o_names[] = {
+    "move", "nonblocking", "more", NULL
+  };
+  unsigned int flags = 0;
+  const int top = lua_gettop(L);
+
+  for (; idx <= top; ++idx) {
+    flags |= o_flags[luaL_checkoption(L, idx, NULL, o_names)];
+  }
+  return flags;
+}
+
+/*
+ * Arguments: src (sd_udata | fd_udata), dst (sd_udata | fd_udata),
+ *	[count (number), options (string: "move", "nonblocking", "more") ...]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * One of descriptors must be a pipe.
+ */
+static int
+sock_splice (lua_State *L)
+{
+  const int fd_in = sock_splice_fd(L, 1);
+  const int fd_out = sock_splice_fd(L, 2);
+  const size_t n = lua_isnoneornil(L, 3) ? SPLICE_CHUNK
+   : (size_t) luaL_checkinteger(L, 3);
+  const unsigned int flags = sock_splice_flags(L, 4);
+  ssize_t nw;
+
+  sys_vm_leave(L);
+  do nw = splice(fd_in, NULL, fd_out, NULL, n, flags);
+  while (nw == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nw == -1) {
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pushinteger(L, nw);
+  return 1;
+}
+
+/*
+ * Arguments: src (fd_udata), dst (fd_udata),
+ *	[count (number), options (string: "nonblocking") ...]
+ * Returns: [count (number) | false (EAGAIN)]
+ *
+ * Duplicate pipe's content to other pipe without consuming it.
+ */
+static int
+sock_tee (lua_State *L)
+{
+  const int fd_in = sock_splice_fd(L, 1);
+  const int fd_out = sock_splice_fd(L, 2);
+  const size_t n = lua_isnoneornil(L, 3) ? SPLICE_CHUNK
+   : (size_t) luaL_checkinteger(L, 3);
+  const unsigned int flags = sock_splice_flags(L, 4);
+  ssize_t nw;
+
+  sys_vm_leave(L);
+  do nw = tee(fd_in, fd_out, n, flags);
+  while (nw == -1 && sys_eintr());
+  sys_vm_enter(L);
+
+  if (nw == -1) {
+    if (!SYS_IS_EAGAIN(SYS_ERRNO))
+      return sys_seterror(L, 0);
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  lua_pushinteger(L, nw);
+  return 1;
+}
+
+/*
+ * Arguments: splice_pipe_udata
+ */
+static int
+sock_splice_pipe_close (lua_State *L)
+{
+  struct splice_pipe *sp = checkudata(L, 1, SPLICE_TYPENAME);
+
+  if (sp->fd[0] != -1) {
+    close(sp->fd[0]);
+    close(sp->fd[1]);
+    sp->fd[0] = sp->fd[1] = -1;
+  }
+  return 0;
+}
+
+/*
+ * Get the socket's pipe (from pool of idle pipes when not bound).
+ * Arguments: sd_udata, ...
+ * Returns: [splice_pipes (table), splice_pipe_udata]
+ */
+static struct splice_pipe *
+sock_splice_pipe (lua_State *L)
+{
+  struct splice_pipe *sp;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, SD_SPLICE_PIPES);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);  /* sockets with pipes (weak keys) & pool */
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, SD_SPLICE_PIPES);
+  }
+
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  sp = lua_touserdata(L, -1);
+  if (sp) return sp;
+  lua_pop(L, 1);
+
+  /* take from pool */
+  {
+    const int n = (int) lua_rawlen(L, -1);
+
+    if (n) {
+      lua_rawgeti(L, -1, n);
+      lua_pushnil(L);
+      lua_rawseti(L, -3, n);
+      sp = lua_touserdata(L, -1);
+    } else {
+      sp = lua_newuserdata(L, sizeof(struct splice_pipe));
+      sp->fd[0] = sp->fd[1] = -1;
+      sp->pending = 0;
+      luaL_getmetatable(L, SPLICE_TYPENAME);
+      lua_setmetatable(L, -2);
+
+      if (pipe2(sp->fd, O_NONBLOCK | O_CLOEXEC)) {
+        sp->fd[0] = sp->fd[1] = -1;
+        return NULL;
+      }
+    }
+  }
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  return sp;
+}
+
+/*
+ * Move pending bytes from pipe to destination.
+ * Returns: -1 on error
+ */
+static int
+sock_splice_flush (struct splice_pipe *sp, const int fd_out)
+{
+  while (sp->pending) {
+    ssize_t nw;
+
+    do nw = splice(sp->fd[0], NULL, fd_out, NULL, sp->pending,
+     SPLICE_F_MOVE | SPLICE_F_MORE);
+    while (nw == -1 && sys_eintr());
+
+    if (nw == -1)
+      return SYS_IS_EAGAIN(SYS_ERRNO) ? 0 : -1;
+    sp->pending -= nw;
+  }
+  return 0;
+}
+
+/*
+ * Arguments: sd_udata, dst (sd_udata | fd_udata),
+ *	[count (number), mirror (fd_udata of pipe)]
+ * Returns: [count (number), pending (number), [mirrored (number)]
+ *	| false (EAGAIN)]
+ *
+ * Data read from socket is moved to destination through kernel pipe;
+ * count == 0 and pending == 0 mean EOF.  Blocking behavior follows
+ * the socket's and destination's nonblocking flags.
+ *
+ * Mirror is fed by tee(2) without blocking: mirrored is the count of
+ * bytes copied to it by this call, less than read when the mirror pipe
+ * is full (those bytes are not mirrored).  Mirror errors are reported.
+ */
+static int
+sock_proxy_to (lua_State *L)
+{
+  const sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  const int fd_out = sock_splice_fd(L, 2);
+  const size_t n = lua_isnoneornil(L, 3) ? SPLICE_CHUNK
+   : (size_t) luaL_checkinteger(L, 3);
+  const int fd_mirror = lua_isnoneornil(L, 4) ? -1 : sock_splice_fd(L, 4);
+  struct splice_pipe *sp;
+  size_t pending;
+  ssize_t nr = 0, nm = 0;
+  int res;
+
+  lua_settop(L, 4);
+  sp = sock_splice_pipe(L);
+  if (!sp) return sys_seterror(L, 0);
+
+  pending = sp->pending;
+
+  sys_vm_leave(L);
+  /* move the rest of previous data */
+  res = sock_splice_flush(sp, fd_out);
+  if (!res && !sp->pending) {
+    do nr = splice(sd, NULL, sp->fd[1], NULL, n, SPLICE_F_MOVE);
+    while (nr == -1 && sys_eintr());
+
+    if (nr > 0) {
+      sp->pending = nr;
+      if (fd_mirror != -1) {
+        do nm = tee(sp->fd[0], fd_mirror, nr, SPLICE_F_NONBLOCK);
+        while (nm == -1 && sys_eintr());
+
+        if (nm == -1) {
+          if (SYS_IS_EAGAIN(SYS_ERRNO))
+            nm = 0;
+          else
+            res = -1;  /* data is kept in pipe for next call */
+        }
+      }
+      if (!res) res = sock_splice_flush(sp, fd_out);
+    }
+  }
+  sys_vm_enter(L);
+
+  if (res || (nr == -1 && !SYS_IS_EAGAIN(SYS_ERRNO)))
+    return sys_seterror(L, 0);
+
+  /* moved count */
+  pending = pending + (nr > 0 ? nr : 0) - sp->pending;
+
+  if (!sp->pending) {
+    /* return the pipe to pool */
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, 5);
+
+    if (lua_rawlen(L, 5) < SPLICE_POOL_MAX) {
+      lua_rawseti(L, 5, (int) lua_rawlen(L, 5) + 1);
+    }
+    if (nr == -1 && !pending) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+  lua_pushinteger(L, pending);
+  lua_pushinteger(L, sp->pending);
+  if (fd_mirror == -1) return 2;
+  lua_pushinteger(L, nm);
+  return 3;
+}
+
+#endif
+
+
+#ifdef USE_KTLS
+
+#ifndef SOL_TLS
+#define SOL_TLS		282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP		31
+#endif
+
+struct ktls_cipher {
+  const char *name;
+  unsigned short type;
+  unsigned char iv_len, key_len, salt_len, seq_len;
+};
+
+#define KTLS_CIPHER(name, c) \
+  {name, TLS_CIPHER_##c, TLS_CIPHER_##c##_IV_SIZE, \
+   TLS_CIPHER_##c##_KEY_SIZE, TLS_CIPHER_##c##_SALT_SIZE, \
+   TLS_CIPHER_##c##_REC_SEQ_SIZE}
+
+static const struct ktls_cipher ktls_ciphers[] = {
+  KTLS_CIPHER("aes_gcm_128", AES_GCM_128),
+  KTLS_CIPHER("aes_gcm_256", AES_GCM_256),
+#ifdef TLS_CIPHER_AES_CCM_128
+  KTLS_CIPHER("aes_ccm_128", AES_CCM_128),
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  KTLS_CIPHER("chacha20_poly1305", CHACHA20_POLY1305),
+#endif
+  {NULL, 0, 0, 0, 0, 0}
+};
+
+#define KTLS_INFO_MAX	64  /* maximum size of crypto info */
+
+/*
+ * Copy the fixed size string argument.
+ * Returns: pointer to end of copied string
+ */
+static unsigned char *
+sock_ktls_field (lua_State *L, int idx, unsigned char *p,
+                 const size_t len, const char *msg)
+{
+  size_t n;
+  const char *s = luaL_checklstring(L, idx, &n);
+
+  if (n != len) luaL_argerror(L, idx, msg);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/*
+ * Arguments: sd_udata, direction ("tx", "rx"), version ("1.2", "1.3"),
+ *	cipher ("aes_gcm_128", "aes_gcm_256", "aes_ccm_128",
+ *	"chacha20_poly1305"), key (string), iv (string),
+ *	salt (string), rec_seq (string)
+ * Returns: [sd_udata]
+ */
+static int
+sock_ktls (lua_State *L)
+{
+  static const int dir_flags[] = {TLS_TX, TLS_RX};
+  static const char *const dir_names[] = {"tx", "rx", NULL};
+  static const unsigned short ver_flags[] = {
+    TLS_1_2_VERSION, TLS_1_3_VERSION
+  };
+  static const char *const ver_names[] = {"1.2", "1.3", NULL};
+
+  sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
+  const int dir = dir_flags[luaL_checkoption(L, 2, NULL, dir_names)];
+  const unsigned short version =
+   ver_flags[luaL_checkoption(L, 3, NULL, ver_names)];
+  const char *cipher_name = luaL_checkstring(L, 4);
+  const struct ktls_cipher *cipher = ktls_ciphers;
+  union {
+    struct tls_crypto_info info;
+    unsigned char buf[KTLS_INFO_MAX];
+  } crypto;
+  unsigned char *p;
+
+  for (; cipher->name && strcmp(cipher->name, cipher_name); ++cipher)
+    continue;
+  if (!cipher->name) luaL_argerror(L, 4, "unknown cipher");
+
+  memset(&crypto, 0, sizeof(crypto));
+  crypto.info.version = version;
+  crypto.info.cipher_type = cipher->type;
+
+  /* tls12_crypto_info_*: info, iv, key, salt, rec_seq */
+  p = crypto.buf + sizeof(struct tls_crypto_info);
+  p = sock_ktls_field(L, 6, p, cipher->iv_len, "invalid iv size");
+  p = sock_ktls_field(L, 5, p, cipher->key_len, "invalid key size");
+  p = sock_ktls_field(L, 7, p, cipher->salt_len, "invalid salt size");
+  p = sock_ktls_field(L, 8, p, cipher->seq_len, "invalid rec_seq size");
+
+  if ((setsockopt(sd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"))
+    && SYS_ERRNO != EEXIST)
+   || setsockopt(sd, SOL_TLS, dir, &crypto, (socklen_t) (p - crypto.buf))) {
+    memset(&crypto, 0, sizeof(crypto));
+    return sys_seterror(L, 0);
+  }
+  memset(&crypto, 0, sizeof(crypto));  /* clear key material */
+  lua_settop(L, 1);
+  return 1;
+}
+
+#endif
+
+
 #ifdef _WIN32
 
 #define USE_SENDFILE
@@ -671,8 +1820,11 @@ sock_recv (lua_State *L)
 #define SENDFILE_MAX	(16 * 1024 * 1024)
 #define SYS_GRAN_MASK	(64 * 1024 - 1)
 
+/*
+ * Offset -1 means the current file position, which is advanced.
+ */
 static DWORD
-TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n)
+TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n, int64_t offset)
 {
   HANDLE hmap = CreateFileMapping(fd, NULL, PAGE_READONLY, 0, 0, NULL);
   DWORD res = 0;
@@ -686,7 +1838,12 @@ TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n)
       LONG off_hi = 0L, off_lo;
       int64_t size;
 
-      off_lo = SetFilePointer(fd, 0, &off_hi, SEEK_CUR);
+      if (offset < 0)
+        off_lo = SetFilePointer(fd, 0, &off_hi, SEEK_CUR);
+      else {
+        off_hi = INT64_HIGH(offset);
+        off_lo = INT64_LOW(offset);
+      }
       size = INT64_MAKE(size_lo, size_hi) - INT64_MAKE(off_lo, off_hi);
 
       if (size > (int64_t) SENDFILE_MAX)
@@ -708,7 +1865,7 @@ TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n)
       wsa_buf.len = n;
       wsa_buf.buf = base + map_off;
 
-      if (!WSASend(sd, &wsa_buf, 1, &res, 0, NULL, NULL)) {
+      if (!WSASend(sd, &wsa_buf, 1, &res, 0, NULL, NULL) && offset < 0) {
         LONG off_hi = 0L;
         SetFilePointer(fd, res, &off_hi, SEEK_CUR);
       }
@@ -729,8 +1886,10 @@ TransmitFileMap (SOCKET sd, HANDLE fd, DWORD n)
 #ifdef USE_SENDFILE
 
 /*
- * Arguments: sd_udata, fd_udata, [count (number)]
+ * Arguments: sd_udata, fd_udata, [count (number), offset (number)]
  * Returns: [count (number) | false (EAGAIN)]
+ *
+ * With offset the file position is not used nor changed.
  */
 static int
 sock_sendfile (lua_State *L)
@@ -738,27 +1897,47 @@ sock_sendfile (lua_State *L)
   sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
   fd_t fd = (fd_t) lua_unboxinteger(L, 2, FD_TYPENAME);
   size_t n = (size_t) lua_tointeger(L, 3);
+  const lua_Number offset = lua_isnoneornil(L, 4) ? -1
+   : lua_tonumber(L, 4);
+  const int64_t off = (int64_t) offset;  /* to avoid warning */
   ssize_t res;
 
   sys_vm_leave(L);
 #ifndef _WIN32
 #if defined(__linux__)
-  do res = sendfile(sd, fd, NULL, n ? n : ~((size_t) 0));
-  while (res == -1 && sys_eintr());
+  {
+    off_t pos = (off_t) off;
+    size_t left = n ? n : ~((size_t) 0);
+
+    /* send until count or EOF */
+    res = 0;
+    do {
+      ssize_t nw;
+
+      do nw = sendfile(sd, fd, (off < 0) ? NULL : &pos, left);
+      while (nw == -1 && sys_eintr());
+      if (nw <= 0) {
+        if (!res) res = nw;
+        break;
+      }
+      res += nw;
+      left -= nw;
+    } while (left);
+  }
 #else
   {
-    off_t nw, off = lseek(fd, 0, SEEK_CUR);
+    off_t nw, pos = (off < 0) ? lseek(fd, 0, SEEK_CUR) : (off_t) off;
 
 #if defined(__APPLE__) && defined(__MACH__)
     nw = n;
-    do res = sendfile(fd, sd, off, &nw, NULL, 0);
+    do res = sendfile(fd, sd, pos, &nw, NULL, 0);
 #else
-    do res = sendfile(fd, sd, off, n, NULL, &nw, 0);
+    do res = sendfile(fd, sd, pos, n, NULL, &nw, 0);
 #endif
     while (res == -1 && sys_eintr());
     if (res != -1) {
       res = (size_t) nw;
-      lseek(fd, nw, SEEK_CUR);
+      if (off < 0) lseek(fd, nw, SEEK_CUR);
     }
   }
 #endif
@@ -770,7 +1949,7 @@ sock_sendfile (lua_State *L)
       return 1;
     }
 #else
-  res = TransmitFileMap(sd, fd, (DWORD) n);
+  res = TransmitFileMap(sd, fd, (DWORD) n, off);
   sys_vm_enter(L);
 
   if (res != 0L) {
@@ -793,41 +1972,62 @@ sock_write (lua_State *L)
 {
   sd_t sd = (sd_t) lua_unboxinteger(L, 1, SD_TYPENAME);
   ssize_t n = 0;  /* number of chars actually write */
-  int i, narg = lua_gettop(L);
+  int i = 2, narg = lua_gettop(L);
+  int done = 1;
 
-  for (i = 2; i <= narg; ++i) {
-    struct sys_buffer sb;
-    int nw;
+  while (i <= narg) {
+    struct sys_buffer sbs[SYS_IOV_MAX];
+#ifndef _WIN32
+    struct iovec iov[SYS_IOV_MAX];
+#else
+    WSABUF iov[SYS_IOV_MAX];
+#endif
+    size_t len = 0;
+    ssize_t nw;
+    int k, nbuf;
+
+    /* gather the buffers */
+    nbuf = sys_buffer_read_initv(L, &i, narg, sbs, SYS_IOV_MAX);
+    if (!nbuf) continue;
+
+    for (k = 0; k < nbuf; ++k) {
+#ifndef _WIN32
+      iov[k].iov_base = sbs[k].ptr.w;
+      iov[k].iov_len = sbs[k].size;
+#else
+      iov[k].buf = sbs[k].ptr.w;
+      iov[k].len = (ULONG) sbs[k].size;
+#endif
+      len += sbs[k].size;
+    }
 
-    if (!sys_buffer_read_init(L, i, &sb))
-      continue;
     sys_vm_leave(L);
 #ifndef _WIN32
-    do nw = write(sd, sb.ptr.r, sb.size);
+    do nw = writev(sd, iov, nbuf);
     while (nw == -1 && sys_eintr());
 #else
     {
-      WSABUF wsa_buf;
       DWORD l;
 
-      wsa_buf.len = (ULONG) sb.size;
-      wsa_buf.buf = sb.ptr.w;
-
-      nw = !WSASend(sd, &wsa_buf, 1, &l, 0, NULL, NULL)
-       ? (int) l : -1;
+      nw = !WSASend(sd, iov, (DWORD) nbuf, &l, 0, NULL, NULL)
+       ? (ssize_t) l : -1;
     }
 #endif
     sys_vm_enter(L);
     if (nw == -1) {
+      done = 0;
       if (n > 0 || SYS_IS_EAGAIN(SYS_ERRNO))
         break;
       return sys_seterror(L, 0);
     }
     n += nw;
-    sys_buffer_read_next(&sb, nw);
-    if ((size_t) nw < sb.size) break;
+    sys_buffer_read_nextv(sbs, nbuf, nw);
+    if ((size_t) nw < len) {
+      done = 0;
+      break;
+    }
   }
-  lua_pushboolean(L, (i > narg));
+  lua_pushboolean(L, done);
   lua_pushinteger(L, n);
   return 2;
 }
@@ -853,7 +2053,7 @@ sock_read (lua_State *L)
   sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
   do {
     rlen = (n <= sb.size) ? n : sb.size;
-    if (td) sys_vm2_leave(td);
+    sys_vm_leave(L);
 #ifndef _WIN32
     do nr = read(sd, sb.ptr.w, rlen);
     while (nr == -1 && sys_eintr());
@@ -869,7 +2069,7 @@ sock_read (lua_State *L)
        ? (int) l : -1;
     }
 #endif
-    if (td) sys_vm2_enter(td);
+    sys_vm_enter(L);
     if (nr == -1) break;
     n -= nr;  /* still have to read 'n' bytes */
   } while ((n != 0L && nr == (int) rlen)  /* until end of count or eof */
@@ -917,9 +2117,28 @@ static luaL_Reg sock_meth[] = {
   {"bind",		sock_bind},
   {"listen",		sock_listen},
   {"accept",		sock_accept},
+  {"accept_many",	sock_accept_many},
   {"connect",		sock_connect},
   {"send",		sock_send},
   {"recv",		sock_recv},
+#ifdef USE_MMSG
+  {"send_many",		sock_send_many},
+  {"recv_many",		sock_recv_many},
+#endif
+#ifdef USE_UDP_GSO
+  {"send_gso",		sock_send_gso},
+  {"recv_gro",		sock_recv_gro},
+#endif
+#ifdef USE_ZEROCOPY
+  {"send_zc",		sock_send_zc},
+  {"zc_complete",	sock_zc_complete},
+#endif
+#ifdef USE_SPLICE
+  {"proxy_to",		sock_proxy_to},
+#endif
+#ifdef USE_KTLS
+  {"ktls",		sock_ktls},
+#endif
 #ifdef USE_SENDFILE
   {"sendfile",		sock_sendfile},
 #endif
@@ -933,7 +2152,15 @@ static luaL_Reg sock_meth[] = {
 
 static luaL_Reg sock_lib[] = {
   {"handle",		sock_new},
+#ifdef USE_SPLICE
+  {"splice",		sock_splice},
+  {"tee",		sock_tee},
+#endif
   ADDR_METHODS,
+#ifdef USE_RESOLVER
+  RESOLV_METHODS,
+#endif
+  POOL_METHODS,
   {NULL, NULL}
 };
 
@@ -997,5 +2224,26 @@ luaopen_sys_sock (lua_State *L)
   luaL_setfuncs(L, addr_meth, 0);
   lua_pop(L, 1);
 
+  luaL_newmetatable(L, POOL_TYPENAME);
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, pool_meth, 0);
+  lua_pop(L, 1);
+
+#ifdef USE_RESOLVER
+  luaL_newmetatable(L, RESOLV_TYPENAME);
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, resolv_meth, 0);
+  lua_pop(L, 1);
+#endif
+
+#ifdef USE_SPLICE
+  luaL_newmetatable(L, SPLICE_TYPENAME);
+  lua_pushcfunction(L, sock_splice_pipe_close);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+#endif
+
   return 1;
 }
@@ -61,6 +61,35 @@ sys_milliseconds (void)
 }
 #endif
 
+/*
+ * Monotonic high resolution time for intervals measurement.
+ */
+int64_t
+sys_microseconds (void)
+{
+#ifndef _WIN32
+#if defined(SYS_MONOTONIC_CLOCKID)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+#elif defined(SYS_MONOTONIC_MACH)
+  return (int64_t) sys_absolutetonanos(mach_absolute_time()) / 1000L;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000L + tv.tv_usec;
+#endif
+#else
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (int64_t) (now.QuadPart * 1000000.0 / freq.QuadPart);
+#endif
+}
+
 /*
  * Returns: milliseconds (number)
  */
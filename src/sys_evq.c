@@ -494,9 +494,14 @@ levq_signal (lua_State *L)
 
 /*
  * Arguments: evq_udata, sd_udata,
- *	event (string: "r", "w", "accept", "connect"),
+ *	event (string: "r", "w", "accept", "connect", "zerocopy"),
  *	callback (function), [timeout (milliseconds), one_shot (boolean)]
  * Returns: [ev_ludata]
+ *
+ * Note: "zerocopy" event watches a duplicate of the socket's descriptor:
+ * delete the event before closing the socket, else the connection stays
+ * open. Pending completions set the socket's error condition, so they
+ * also wake up "r" and "w" events of the socket.
  */
 static int
 levq_add_socket (lua_State *L)
@@ -512,6 +517,13 @@ levq_add_socket (lua_State *L)
     case 'c':  /* connect */
       ev_flags |= EVENT_SOCKET_ACC_CONN | EVENT_WRITE | EVENT_ONESHOT;
       break;
+    case 'z':  /* zerocopy completions */
+#ifdef USE_EPOLL
+      ev_flags |= EVENT_SOCKET_ERRQUEUE | EVENT_READ;
+#else
+      luaL_argerror(L, 3, "zerocopy not supported");
+#endif
+      break;
     default:
       ev_flags |= (evstr[0] == 'r') ? EVENT_READ : EVENT_WRITE;
     }
@@ -595,48 +595,75 @@ sys_write (lua_State *L)
 {
   fd_t fd = (fd_t) lua_unboxinteger(L, 1, FD_TYPENAME);
   ssize_t n = 0;  /* number of chars actually write */
-  int i, narg = lua_gettop(L);
+  int i = 2, narg = lua_gettop(L);
+  int done = 1;
 #ifdef _WIN32
   DWORD is_con = GetConsoleMode(fd, &is_con);
 #endif
 
-  for (i = 2; i <= narg; ++i) {
-    struct sys_buffer sb;
-    int nw;
+  while (i <= narg) {
+    struct sys_buffer sbs[SYS_IOV_MAX];
+    size_t len = 0;
+    ssize_t nw;
+    int k, nbuf;
+#ifndef _WIN32
+    struct iovec iov[SYS_IOV_MAX];
+#endif
+
+    /* gather the buffers */
+    nbuf = sys_buffer_read_initv(L, &i, narg, sbs, SYS_IOV_MAX);
+    if (!nbuf) continue;
+
+    for (k = 0; k < nbuf; ++k) {
+#ifndef _WIN32
+      iov[k].iov_base = sbs[k].ptr.w;
+      iov[k].iov_len = sbs[k].size;
+#endif
+      len += sbs[k].size;
+    }
 
-    if (!sys_buffer_read_init(L, i, &sb))
-      continue;
     sys_vm_leave(L);
 #ifndef _WIN32
-    do nw = write(fd, sb.ptr.r, sb.size);
+    do nw = writev(fd, iov, nbuf);
     while (nw == -1 && sys_eintr());
 #else
     {
-      DWORD l;
-      if (is_con) {
-        const UINT old_cp = GetConsoleOutputCP();
-
-        SetConsoleOutputCP(65001);  /* CP_UTF8 */
-        nw = WriteFile(fd, sb.ptr.r, (DWORD) sb.size, &l, NULL)
-         ? (int) sb.size : -1;
-        SetConsoleOutputCP(old_cp);
-      } else {
-        nw = WriteFile(fd, sb.ptr.r, (DWORD) sb.size, &l, NULL)
-         ? (int) l : -1;
+      const UINT old_cp = is_con ? GetConsoleOutputCP() : 0;
+
+      if (is_con) SetConsoleOutputCP(65001);  /* CP_UTF8 */
+
+      /* no gathering write for files: write the buffers in turn */
+      for (nw = 0, k = 0; k < nbuf; ++k) {
+        const DWORD size = (DWORD) sbs[k].size;
+        DWORD l;
+
+        if (!WriteFile(fd, sbs[k].ptr.r, size, &l, NULL)) {
+          if (!nw) nw = -1;
+          break;
+        }
+        if (is_con) l = size;
+        nw += l;
+        if (l < size) break;
       }
+
+      if (is_con) SetConsoleOutputCP(old_cp);
     }
 #endif
     sys_vm_enter(L);
     if (nw == -1) {
+      done = 0;
       if (n > 0 || SYS_IS_EAGAIN(SYS_ERRNO))
         break;
       return sys_seterror(L, 0);
     }
     n += nw;
-    sys_buffer_read_next(&sb, nw);
-    if ((size_t) nw < sb.size) break;
+    sys_buffer_read_nextv(sbs, nbuf, nw);
+    if ((size_t) nw < len) {
+      done = 0;
+      break;
+    }
   }
-  lua_pushboolean(L, (i > narg));
+  lua_pushboolean(L, done);
   lua_pushinteger(L, n);
   return 2;
 }
@@ -662,7 +689,7 @@ sys_read (lua_State *L)
   sys_buffer_write_init(L, 2, &sb, buf, sizeof(buf));
   do {
     rlen = (n <= sb.size) ? n : sb.size;
-    if (td) sys_vm2_leave(td);
+    sys_vm_leave(L);
 #ifndef _WIN32
     do nr = read(fd, sb.ptr.w, rlen);
     while (nr == -1 && sys_eintr());
@@ -673,7 +700,7 @@ sys_read (lua_State *L)
        ? (int) l : -1;
     }
 #endif
-    if (td) sys_vm2_enter(td);
+    sys_vm_enter(L);
     if (nr == -1) break;
     n -= nr;  /* still have to read 'n' bytes */
   } while ((n != 0L && nr == (int) rlen)  /* until end of count or eof */
@@ -850,6 +877,96 @@ sys_utime (lua_State *L)
   return sys_seterror(L, 0);
 }
 
+#ifndef _WIN32
+
+#if defined(__linux__) && defined(__GLIBC__) \
+ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define USE_COPY_FILE_RANGE
+#endif
+
+#define FILE_COPY_CHUNK	(64 * 1024 * 1024)
+
+/*
+ * Copy through user space buffer.
+ * Returns: number of copied bytes or -1 on error
+ */
+static ssize_t
+sys_copy_rw (fd_t fd_in, off_t *off_in, fd_t fd_out, off_t *off_out,
+             size_t len)
+{
+  char buf[SYS_BUFSIZE];
+  ssize_t nr, nw, n = 0;
+
+  if (len > sizeof(buf)) len = sizeof(buf);
+
+  do nr = off_in ? pread(fd_in, buf, len, *off_in) : read(fd_in, buf, len);
+  while (nr == -1 && sys_eintr());
+  if (nr <= 0) return nr;
+
+  while (n < nr) {
+    do nw = off_out ? pwrite(fd_out, buf + n, nr - n, *off_out + n)
+     : write(fd_out, buf + n, nr - n);
+    while (nw == -1 && sys_eintr());
+    if (nw == -1) return -1;
+    n += nw;
+  }
+  if (off_in) *off_in += nr;
+  if (off_out) *off_out += nr;
+  return nr;
+}
+
+/*
+ * Arguments: src (fd_udata), dst (fd_udata),
+ *	[offset_in (number), offset_out (number), count (number)]
+ * Returns: [count (number)]
+ *
+ * Without offset the file position is used and advanced;
+ * without count data is copied until EOF.
+ */
+static int
+sys_copy_file_range (lua_State *L)
+{
+  fd_t fd_in = (fd_t) lua_unboxinteger(L, 1, FD_TYPENAME);
+  fd_t fd_out = (fd_t) lua_unboxinteger(L, 2, FD_TYPENAME);
+  const lua_Number offset_in = lua_isnoneornil(L, 3) ? -1
+   : lua_tonumber(L, 3);
+  const lua_Number offset_out = lua_isnoneornil(L, 4) ? -1
+   : lua_tonumber(L, 4);
+  const lua_Number count = lua_isnoneornil(L, 5) ? -1 : lua_tonumber(L, 5);
+  off_t off_in = (off_t) offset_in, off_out = (off_t) offset_out;
+  off_t *poff_in = (off_in < 0) ? NULL : &off_in;
+  off_t *poff_out = (off_out < 0) ? NULL : &off_out;
+  int64_t left = (int64_t) count;  /* -1: until EOF */
+  int64_t total = 0;
+  ssize_t n = 0;
+
+  sys_vm_leave(L);
+  while (left) {
+    const size_t len = (left < 0 || left > FILE_COPY_CHUNK)
+     ? FILE_COPY_CHUNK : (size_t) left;
+
+#ifdef USE_COPY_FILE_RANGE
+    do n = copy_file_range(fd_in, poff_in, fd_out, poff_out, len, 0);
+    while (n == -1 && sys_eintr());
+    if (n == -1 && (SYS_ERRNO == EXDEV || SYS_ERRNO == ENOSYS
+     || SYS_ERRNO == EOPNOTSUPP || SYS_ERRNO == EINVAL))
+#endif
+      n = sys_copy_rw(fd_in, poff_in, fd_out, poff_out, len);
+
+    if (n <= 0) break;
+    total += n;
+    if (left > 0) left -= n;
+  }
+  sys_vm_enter(L);
+
+  if (n == -1 && !total)
+    return sys_seterror(L, 0);
+  lua_pushnumber(L, (lua_Number) total);
+  return 1;
+}
+
+#endif
+
 /*
  * Arguments: fd_udata
  * Returns: string
@@ -870,8 +987,14 @@ sys_tostring (lua_State *L)
 #include "sys_comm.c"
 
 
+#ifndef _WIN32
+#define FD_METHODS \
+  {"handle",		sys_file}, \
+  {"copy_file_range",	sys_copy_file_range}
+#else
 #define FD_METHODS \
   {"handle",		sys_file}
+#endif
 
 static luaL_Reg fd_meth[] = {
   {"open",		sys_open},
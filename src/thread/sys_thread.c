@@ -45,6 +45,16 @@ typedef pthread_t		thread_id_t;
 #define THREAD_XDUP_TAG		"xdup__"
 
 #define THREAD_STACK_SIZE	(64 * 1024)
+#define THREAD_GUARD_DEFAULT	((size_t) -1)  /* system's default */
+
+#if defined(__linux__)
+#define USE_STACK_PEAK
+#define THREAD_STACK_PATTERN	0xA5
+#define THREAD_STACK_MARGIN	1024  /* don't paint the live frames */
+#endif
+
+#define VMLOCK_SPIN_MIN		10
+#define VMLOCK_SPIN_MAX		100
 
 struct sys_vmthread;
 struct sched_context;
@@ -68,7 +78,19 @@ struct sys_thread {
 #define SYS_THREAD_INTERRUPT	4
   unsigned int volatile flags;
 
+  unsigned int vm_kept;  /* VM-lock is kept over sys_vm_leave() */
+
   struct sched_context *sched_ctx;  /* running scheduler's context */
+
+  affin_mask_t *cpus;  /* bind to processors set instead of VM's one */
+
+  thread_event_t *chan_tev;  /* to wait on channels */
+
+  size_t stack_size;  /* 0: VM-thread's default */
+  size_t guard_size;  /* THREAD_GUARD_DEFAULT: VM-thread's default */
+  size_t stack_peak;  /* peak stack usage on exit */
+  char *stack_low, *stack_high;  /* painted stack bounds */
+  unsigned int stack_paint;  /* measure the peak stack usage */
 };
 
 /* Main VM-thread's data */
@@ -77,10 +99,18 @@ struct sys_vmthread {
 
   thread_critsect_t vmcs;
 
-  unsigned int volatile nref;
+  unsigned int volatile nref;  /* number of sub-threads (guarded by vmcs) */
+
+  /* adaptive VM-lock */
+  thread_atomic_t nparked;  /* number of threads waiting for vmcs */
+  int spin, spin_max;  /* estimated and maximum spins count */
+  unsigned int handoff:	1;  /* don't spin, while threads are parked */
+  unsigned int nlocks, ncontended, nparks;  /* contention counters */
 
   int cpu;  /* bind to processor (inherited by sub-threads) */
+  affin_mask_t *cpus;  /* bind to processors set (inherited by sub-threads) */
   size_t stack_size;  /* for new threads */
+  size_t guard_size;  /* for new threads */
 };
 
 #define INVALID_TLS_INDEX	(thread_key_t) -1
@@ -112,10 +142,57 @@ static thread_key_t g_TLSIndex = INVALID_TLS_INDEX;
 
 static void sched_vm_switch (struct sched_context *sched_ctx,
                              const int enter_vm);
+static int sched_preempt_init (void);
 
 static void thread_createmeta (lua_State *L);
 
 
+/*
+ * Spin a while before parking on the VM-lock.
+ *
+ * Note: The "handoff" option only stops new entrants from trying and
+ * spinning while other threads are parked; the mutex isn't fair,
+ * so a woken thread still can be overtaken.
+ */
+static void
+thread_vm_lock (struct sys_vmthread *vmtd)
+{
+  thread_critsect_t *csp = &vmtd->vmcs;
+  int spins = 0, park = 0;
+
+  if (vmtd->handoff && vmtd->nparked)
+    park = 1;
+  else if (thread_critsect_trylock(csp)) {
+    int max_spins = vmtd->spin * 2 + VMLOCK_SPIN_MIN;
+
+    if (max_spins > vmtd->spin_max)
+      max_spins = vmtd->spin_max;
+
+    do {
+      if (spins >= max_spins) {
+        park = 1;
+        break;
+      }
+      spins++;
+      thread_cpu_relax();
+    } while (thread_critsect_trylock(csp));
+  }
+
+  if (park) {
+    thread_atomic_add(&vmtd->nparked, 1);
+    thread_critsect_enter(csp);
+    thread_atomic_add(&vmtd->nparked, -1);
+  }
+
+  vmtd->nlocks++;
+  if (spins || park) {
+    vmtd->ncontended++;
+    if (park) vmtd->nparks++;
+
+    vmtd->spin += (spins - vmtd->spin) / 8;
+  }
+}
+
 void
 sys_thread_set (struct sys_thread *td)
 {
@@ -179,6 +256,55 @@ thread_waitvm (struct sys_vmthread *vmtd, const msec_t timeout)
   return res;
 }
 
+#ifdef USE_STACK_PEAK
+
+/*
+ * Fill the unused part of current thread's stack with pattern.
+ */
+static void
+thread_stack_paint (struct sys_thread *td)
+{
+  pthread_attr_t attr;
+  void *addr;
+  size_t size, guard_size = 0;
+  char *low, *high, *end, here;
+
+  if (pthread_getattr_np(pthread_self(), &attr))
+    return;
+  if (pthread_attr_getstack(&attr, &addr, &size)
+   || pthread_attr_getguardsize(&attr, &guard_size)) {
+    pthread_attr_destroy(&attr);
+    return;
+  }
+  pthread_attr_destroy(&attr);
+
+  low = (char *) addr + guard_size;
+  high = (char *) addr + size;
+  end = (char *) ((size_t) &here - THREAD_STACK_MARGIN);
+  if (end <= low || end >= high)
+    return;
+
+  memset(low, THREAD_STACK_PATTERN, end - low);
+  td->stack_low = low;
+  td->stack_high = high;
+}
+
+/*
+ * Returns: peak stack usage in bytes
+ */
+static size_t
+thread_stack_peak (const struct sys_thread *td)
+{
+  const unsigned char *p = (const unsigned char *) td->stack_low;
+  const unsigned char *high = (const unsigned char *) td->stack_high;
+
+  while (p < high && *p == THREAD_STACK_PATTERN)
+    ++p;
+  return (size_t) (high - p);
+}
+
+#endif /* USE_STACK_PEAK */
+
 /*
  * Arguments: [status (number)]
  */
@@ -187,6 +313,7 @@ thread_exit (struct sys_thread *td)
 {
   struct sys_thread *reftd = td->reftd;
   const int is_vm = thread_isvm(td);
+  size_t stack_peak = 0;
   lua_Integer res;
 
   td->sched_ctx = NULL;
@@ -197,6 +324,11 @@ thread_exit (struct sys_thread *td)
   }
   res = td->exit_status;
 
+#ifdef USE_STACK_PEAK
+  if (td->stack_high)
+    td->stack_peak = stack_peak = thread_stack_peak(td);
+#endif
+
   if (is_vm) {
     thread_waitvm(td->vmtd, TIMEOUT_INFINITE);
     lua_close(td->L);
@@ -221,6 +353,7 @@ thread_exit (struct sys_thread *td)
     if (is_vm) {
       reftd->flags = SYS_THREAD_KILLED;
       reftd->exit_status = res;
+      reftd->stack_peak = stack_peak;
 #ifndef _WIN32
       pthread_cond_broadcast(&reftd->cond);
 #endif
@@ -280,7 +413,7 @@ sys_vm2_enter (struct sys_thread *td)
 {
   lua_assert(td);
 
-  thread_critsect_enter(td->vmcsp);
+  thread_vm_lock(td->vmtd);
   sys_vm2_postenter(td);
 }
 
@@ -300,7 +433,10 @@ sys_vm_enter (lua_State *L)
     struct sys_thread *td = sys_thread_get();
 
     if (td) {
-      thread_critsect_enter(td->vmcsp);
+      if (td->vm_kept)
+        td->vm_kept = 0;
+      else
+        thread_vm_lock(td->vmtd);
       sys_vm2_postenter(td);
 
       if (td->flags) sys_thread_check(td, L);
@@ -318,7 +454,11 @@ sys_vm_leave (lua_State *L)
 
     if (td) {
       sys_vm2_preleave(td);
-      thread_critsect_leave(td->vmcsp);
+      /* nobody else can enter the VM, when it has only one thread */
+      if (!td->vmtd->nref)
+        td->vm_kept = 1;
+      else
+        thread_critsect_leave(td->vmcsp);
     }
   }
 }
@@ -489,7 +629,14 @@ thread_newvm (lua_State *L, struct sys_thread *reftd,
     vmtd->td.reftd = reftd;
     vmtd->cpu = vmref->cpu;
     vmtd->stack_size = vmref->stack_size;
+    vmtd->guard_size = vmref->guard_size;
+    if (vmref->cpus)
+      vmtd->cpus = affin_mask_dup(vmref->cpus);
   }
+  if (!reftd)
+    vmtd->guard_size = THREAD_GUARD_DEFAULT;
+  vmtd->td.guard_size = THREAD_GUARD_DEFAULT;
+  vmtd->spin_max = VMLOCK_SPIN_MAX;
 
   if (thread_critsect_new(&vmtd->vmcs))
     return NULL;
@@ -530,6 +677,7 @@ sys_thread_new (lua_State *L, struct sys_thread *vmtd,
   lua_setmetatable(L, -2);
 
   td->reftd = vmtd2 ? vmtd2 : &vmref->td;
+  td->guard_size = THREAD_GUARD_DEFAULT;
   vmref->nref++;
 
   if (thread_cond_new(&td->cond))
@@ -567,6 +715,11 @@ thread_done (lua_State *L)
     if (thread_isvm(td)) {
       thread_critsect_leave(td->vmcsp);
       thread_critsect_del(td->vmcsp);
+
+      if (td->vmtd->cpus) {
+        affin_mask_del(td->vmtd->cpus);
+        td->vmtd->cpus = NULL;
+      }
     } else {
       sys_vm2_leave(td);
 #ifndef _WIN32
@@ -582,6 +735,12 @@ thread_done (lua_State *L)
     }
     (void) thread_cond_del(&td->cond);
 
+    if (td->chan_tev) {
+      (void) thread_event_del(td->chan_tev);
+      free(td->chan_tev);
+      td->chan_tev = NULL;
+    }
+
     lua_rawgetp(L, LUA_REGISTRYINDEX, THREAD_KEY_ADDRESS);
     lua_pushnil(L);
     lua_rawsetp(L, -2, td->L); /* coroutine */
@@ -614,6 +773,8 @@ thread_init (lua_State *L)
     if ((g_TLSIndex = TlsAlloc()) == INVALID_TLS_INDEX)
       goto err;
 #endif
+    if (sched_preempt_init())
+      goto err;
   }
   /* VM Mutex */
   td = sys_thread_get();
@@ -655,6 +816,11 @@ thread_start (struct sys_thread *td)
 {
   lua_State *L = td->L;
 
+#ifdef USE_STACK_PEAK
+  if (td->stack_paint)
+    thread_stack_paint(td);
+#endif
+
   sys_thread_set(td);
   sys_vm2_enter(td);
 
@@ -664,16 +830,26 @@ thread_start (struct sys_thread *td)
   return thread_exit(td);
 }
 
+#define thread_stack_size(td) \
+    ((td)->stack_size ? (td)->stack_size : (td)->vmtd->stack_size)
+#define thread_guard_size(td) \
+    ((td)->guard_size != THREAD_GUARD_DEFAULT \
+     ? (td)->guard_size : (td)->vmtd->guard_size)
+
 static int
 sys_thread_create (struct sys_thread *td, const int is_affin)
 {
 #ifndef _WIN32
+  const size_t stack_size = thread_stack_size(td);
+  const size_t guard_size = thread_guard_size(td);
   pthread_attr_t attr;
   int res;
 
   if ((res = pthread_attr_init(&attr)))
     goto err;
-  if ((res = pthread_attr_setstacksize(&attr, td->vmtd->stack_size))) {
+  if ((res = pthread_attr_setstacksize(&attr, stack_size))
+   || (guard_size != THREAD_GUARD_DEFAULT
+   && (res = pthread_attr_setguardsize(&attr, guard_size)))) {
     pthread_attr_destroy(&attr);
     goto err;
   }
@@ -693,7 +869,11 @@ sys_thread_create (struct sys_thread *td, const int is_affin)
   pthread_attr_destroy(&attr);
   if (!res) {
 #if defined(USE_PTHREAD_AFFIN)
-    if (is_affin)
+    if (td->cpus)
+      affin_mask_set(td->tid, td->cpus);
+    else if (td->vmtd->cpus)
+      affin_mask_set(td->tid, td->vmtd->cpus);
+    else if (is_affin)
       affin_cpu_set(td->tid, td->vmtd->cpu);
 #else
     (void) is_affin;
@@ -705,24 +885,165 @@ sys_thread_create (struct sys_thread *td, const int is_affin)
 #else
   unsigned int tid;
   const uintptr_t hThr = _beginthreadex(NULL,
-   (unsigned int) td->vmtd->stack_size,
-   (thread_func_t) thread_start, td, 0, &tid);
+   (unsigned int) thread_stack_size(td),
+   (thread_func_t) thread_start, td, CREATE_SUSPENDED, &tid);
 
   (void) is_affin;
 
   if (hThr) {
     td->tid = (HANDLE) hThr;
-    if (is_WinNT && td->vmtd->cpu)
+    if (is_WinNT && (td->cpus || td->vmtd->cpus))
+      affin_mask_set(td->tid, td->cpus ? td->cpus : td->vmtd->cpus);
+    else if (is_WinNT && td->vmtd->cpu)
       affin_cpu_set(td->tid, td->vmtd->cpu);
+    ResumeThread(td->tid);
     return 0;
   }
 #endif
   return -1;
 }
 
+/*
+ * Arguments: ..., options (table: {stack_size = number, guard = number,
+ *	stack_peak = boolean}), ...
+ */
+static void
+thread_stack_opt (lua_State *L, const int idx, size_t *stack_sizep,
+                  size_t *guard_sizep, unsigned int *paintp)
+{
+  lua_getfield(L, idx, "stack_size");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    const lua_Integer size = lua_tointeger(L, -1);
+
+    if (size <= 0) luaL_argerror(L, idx, "positive stack_size expected");
+    *stack_sizep = (size_t) size;
+  }
+
+  lua_getfield(L, idx, "guard");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    const lua_Integer size = lua_tointeger(L, -1);
+
+    if (size < 0) luaL_argerror(L, idx, "non-negative guard expected");
+    *guard_sizep = (size_t) size;
+  }
+
+  lua_getfield(L, idx, "stack_peak");
+  *paintp = lua_toboolean(L, -1);
+  lua_pop(L, 3);
+}
+
+/*
+ * Arguments: ..., library names (table: {1..n: string}), ...
+ * Returns: libraries mask
+ */
+static unsigned int
+thread_loadlibs (lua_State *L, const int idx)
+{
+  unsigned int loadlibs = ~0U;  /* load all standard libraries */
+  unsigned int libs = 0;
+  int i;
+
+  for (i = 1; ; ++i) {
+    const char *s;
+    lua_rawgeti(L, idx, i);
+    s = lua_tostring(L, -1);
+    if (!s || !*s) {
+      if (s) loadlibs = 0;  /* don't load any libraries */
+      lua_pop(L, 1);
+      break;
+    }
+    libs |= 1 << luaL_checkoption(L, -1, NULL, stdlib_names);
+    lua_pop(L, 1);
+  }
+  return libs ? libs : loadlibs;
+}
+
+/*
+ * Copy arguments to other VM.
+ * Arguments: ..., [arguments (string | number | boolean | ludata | share_object) ...]
+ */
+static void
+thread_copy_args (lua_State *L, lua_State *NL, const int idx)
+{
+  const int top = lua_gettop(L);
+  int i;
+
+  for (i = idx; i <= top; ++i) {
+    switch (lua_type(L, i)) {
+    case LUA_TSTRING:
+    case LUA_TNUMBER:
+    case LUA_TBOOLEAN:
+    case LUA_TLIGHTUSERDATA:
+    case LUA_TNIL:
+      break;
+    case LUA_TUSERDATA:
+      if (!luaL_getmetafield(L, i, THREAD_XDUP_TAG))
+        luaL_argerror(L, i, "shareable object expected");
+      lua_pop(L, 1);
+      break;
+    default:
+      luaL_argerror(L, i, "primitive type expected");
+    }
+  }
+
+  if (!lua_checkstack(NL, top + LUA_MINSTACK))
+    luaL_error(L, "stack overflow (too many arguments)");
+
+  for (i = idx; i <= top; ++i) {
+    switch (lua_type(L, i)) {
+    case LUA_TSTRING:
+      {
+        size_t len;
+        const char *s = lua_tolstring(L, i, &len);
+        lua_pushlstring(NL, s, len);
+      }
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(NL, lua_tonumber(L, i));
+      break;
+    case LUA_TBOOLEAN:
+      lua_pushboolean(NL, lua_toboolean(L, i));
+      break;
+    case LUA_TLIGHTUSERDATA:
+      lua_pushlightuserdata(NL, lua_touserdata(L, i));
+      break;
+    case LUA_TUSERDATA:
+      luaL_getmetafield(L, i, THREAD_XDUP_TAG);
+      lua_pushvalue(L, i);
+      lua_pushlightuserdata(L, NL);
+      lua_call(L, 2, 0);
+      break;
+    default:
+      lua_pushnil(NL);
+    }
+  }
+}
+
+/*
+ * Arguments: ..., filename (string) | function_dump (string), ...
+ * Returns: [function]
+ */
+static int
+thread_loadchunk (lua_State *L, lua_State *NL, const int idx)
+{
+  size_t len;
+  const char *path = lua_tolstring(L, idx, &len);
+
+  if (path[0] == LUA_SIGNATURE[0]
+   ? luaL_loadbuffer(NL, path, len, "thread")
+   : luaL_loadfile(NL, path)) {
+    lua_pushstring(L, lua_tostring(NL, -1));  /* error message */
+    lua_pop(NL, 1);
+    return -1;
+  }
+  return 0;
+}
+
 #define ARG_LAST	2
 /*
- * Arguments: options (table: {1..n: library names, "cpu": number}),
+ * Arguments: options (table: {1..n: library names, "cpu": number,
+ *	"cpus": {1..n: number}, "node": number, "stack_size": number,
+ *	"guard": number, "stack_peak": boolean}),
  *	filename (string) | function_dump (string),
  *	[arguments (string | number | boolean | ludata | share_object) ...]
  * Returns: [thread_udata]
@@ -730,33 +1051,24 @@ sys_thread_create (struct sys_thread *td, const int is_affin)
 static int
 thread_runvm (lua_State *L)
 {
-  const char *path = luaL_checkstring(L, 2);
   struct sys_thread *vmtd = sys_thread_get();
   struct sys_thread *td, *faketd;
   lua_State *NL;
+  affin_mask_t *cpus = NULL;
   unsigned int loadlibs = ~0U;  /* load all standard libraries */
   int is_affin = 0, cpu = 0;
+  size_t stack_size = 0, guard_size = THREAD_GUARD_DEFAULT;
+  unsigned int stack_paint = 0;
 
+  luaL_checkstring(L, ARG_LAST);
   if (!vmtd) luaL_argerror(L, 0, "Threading not initialized");
 
   /* options */
   if (lua_istable(L, 1)) {
-    unsigned int libs = 0;
-    int i;
-
-    for (i = 1; ; ++i) {
-      const char *s;
-      lua_rawgeti(L, 1, i);
-      s = lua_tostring(L, -1);
-      if (!s || !*s) {
-        if (s) loadlibs = 0;  /* don't load any libraries */
-        lua_pop(L, 1);
-        break;
-      }
-      libs |= 1 << luaL_checkoption(L, -1, NULL, stdlib_names);
-      lua_pop(L, 1);
-    }
-    if (libs) loadlibs = libs;
+    loadlibs = thread_loadlibs(L, 1);
+
+    /* stack */
+    thread_stack_opt(L, 1, &stack_size, &guard_size, &stack_paint);
 
     /* CPU affinity */
     lua_getfield(L, 1, "cpu");
@@ -765,13 +1077,32 @@ thread_runvm (lua_State *L)
       is_affin = 1;
     }
     lua_pop(L, 1);
+
+    /* CPUs set */
+    cpus = affin_mask_opt(L, 1);
   }
 
   td = thread_newvm(NULL, vmtd, loadlibs);
-  if (!td) goto err;
+  if (!td) {
+    if (cpus) affin_mask_del(cpus);
+    goto err;
+  }
+  if (cpus) {
+    if (td->vmtd->cpus) affin_mask_del(td->vmtd->cpus);
+    td->vmtd->cpus = cpus;
+    is_affin = 1;
+  }
+  if (stack_size)
+    td->vmtd->stack_size = stack_size;
+  if (guard_size != THREAD_GUARD_DEFAULT)
+    td->vmtd->guard_size = guard_size;
+  td->stack_paint = stack_paint;
 
   faketd = sys_thread_new(L, vmtd, td, 1);
   if (!faketd) goto err;
+  td->reftd = faketd;  /* notify the fake thread on exit */
+  faketd->stack_size = td->vmtd->stack_size;
+  faketd->guard_size = td->vmtd->guard_size;
 
   lua_replace(L, 1);  /* fake thread_udata */
 
@@ -781,53 +1112,13 @@ thread_runvm (lua_State *L)
   NL = td->L;
 
   /* function */
-  if (path[0] == LUA_SIGNATURE[0]
-   ? luaL_loadbuffer(NL, path, lua_rawlen(L, ARG_LAST), "thread")
-   : luaL_loadfile(NL, path)) {
-    lua_pushstring(L, lua_tostring(NL, -1));  /* error message */
+  if (thread_loadchunk(L, NL, ARG_LAST)) {
     lua_close(NL);
     lua_error(L);
   }
 
   /* arguments */
-  {
-    int i, top = lua_gettop(L);
-
-    luaL_checkstack(NL, top + LUA_MINSTACK, "too many arguments");
-
-    for (i = ARG_LAST + 1; i <= top; ++i) {
-      switch (lua_type(L, i)) {
-      case LUA_TSTRING:
-        {
-          size_t len;
-          const char *s = lua_tolstring(L, i, &len);
-          lua_pushlstring(NL, s, len);
-        }
-        break;
-      case LUA_TNUMBER:
-        lua_pushnumber(NL, lua_tonumber(L, i));
-        break;
-      case LUA_TBOOLEAN:
-        lua_pushboolean(NL, lua_toboolean(L, i));
-        break;
-      case LUA_TLIGHTUSERDATA:
-        lua_pushlightuserdata(NL, lua_touserdata(L, i));
-        break;
-      case LUA_TUSERDATA:
-        if (!luaL_getmetafield(L, i, THREAD_XDUP_TAG))
-          luaL_argerror(L, i, "shareable object expected");
-        lua_pushvalue(L, i);
-        lua_pushlightuserdata(L, NL);
-        lua_call(L, 2, 0);
-        break;
-      case LUA_TNIL:
-        lua_pushnil(NL);
-        break;
-      default:
-        luaL_argerror(L, i, "primitive type expected");
-      }
-    }
-  }
+  thread_copy_args(L, NL, ARG_LAST + 1);
 
   if (!sys_thread_create(td, is_affin)) {
     faketd->tid = td->tid;
@@ -841,30 +1132,59 @@ thread_runvm (lua_State *L)
 #undef ARG_LAST
 
 /*
- * Arguments: function, [arguments (any) ...]
+ * Arguments: [options (table: {stack_size = number, guard = number,
+ *	stack_peak = boolean, cpus = {1..n: number}, node = number})],
+ *	function, [arguments (any) ...]
  * Returns: [thread_udata]
+ *
+ * Without "cpus"/"node" the thread is bound as its VM.
  */
 static int
 thread_run (lua_State *L)
 {
   struct sys_thread *td, *vmtd = sys_thread_get();
+  affin_mask_t *cpus = NULL;
+  size_t stack_size = 0, guard_size = THREAD_GUARD_DEFAULT;
+  unsigned int stack_paint = 0;
+  int res;
 
   if (!vmtd) luaL_argerror(L, 0, "Threading not initialized");
+  if (lua_istable(L, 1)) {
+    thread_stack_opt(L, 1, &stack_size, &guard_size, &stack_paint);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    cpus = affin_mask_opt(L, 1);
+    lua_remove(L, 1);
+  }
   luaL_checktype(L, 1, LUA_TFUNCTION);
 
   td = sys_thread_new(L, vmtd, NULL, 1);
-  if (!td) goto err;
+  if (!td) {
+    if (cpus) affin_mask_del(cpus);
+    goto err;
+  }
+
+  td->stack_size = stack_size;
+  td->guard_size = guard_size;
+  td->stack_paint = stack_paint;
 
   lua_insert(L, 1);  /* thread_udata */
 
   /* function and arguments */
   {
     const int n = lua_gettop(L) - 1;
-    luaL_checkstack(td->L, n, NULL);
+    if (!lua_checkstack(td->L, n)) {
+      if (cpus) affin_mask_del(cpus);
+      luaL_checkstack(td->L, n, NULL);  /* raise the error */
+    }
     lua_xmove(L, td->L, n);
   }
 
-  if (!sys_thread_create(td, 0)) {
+  td->cpus = cpus;
+  res = sys_thread_create(td, 0);
+  td->cpus = NULL;
+  if (cpus) affin_mask_del(cpus);
+
+  if (!res) {
     return 1;
   }
   sys_thread_del(td);
@@ -872,6 +1192,47 @@ thread_run (lua_State *L)
   return sys_seterror(L, 0);
 }
 
+/*
+ * Arguments: [options (table: {spin = number, handoff = boolean})]
+ * Returns: stats (table)
+ */
+static int
+thread_vmlock (lua_State *L)
+{
+  struct sys_thread *td = sys_thread_get();
+  struct sys_vmthread *vmtd;
+
+  if (!td) luaL_argerror(L, 0, "Threading not initialized");
+  vmtd = td->vmtd;
+
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "spin");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      const int spin_max = (int) lua_tointeger(L, -1);
+      vmtd->spin_max = (spin_max < 0) ? 0 : spin_max;
+    }
+    lua_getfield(L, 1, "handoff");
+    if (!lua_isnil(L, -1))
+      vmtd->handoff = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, vmtd->nlocks);
+  lua_setfield(L, -2, "locks");
+  lua_pushinteger(L, vmtd->ncontended);
+  lua_setfield(L, -2, "contended");
+  lua_pushinteger(L, vmtd->nparks);
+  lua_setfield(L, -2, "parks");
+  lua_pushinteger(L, vmtd->spin);
+  lua_setfield(L, -2, "spin");
+  lua_pushinteger(L, vmtd->spin_max);
+  lua_setfield(L, -2, "spin_max");
+  lua_pushboolean(L, vmtd->handoff);
+  lua_setfield(L, -2, "handoff");
+  return 1;
+}
+
 /*
  * Returns: thread_udata, is_main (boolean)
  */
@@ -1115,6 +1476,33 @@ thread_wait (lua_State *L)
   return sys_seterror(L, 0);
 }
 
+/*
+ * Arguments: thread_udata
+ * Returns: stack_size (number), guard_size (number) | default (nil),
+ *	[peak_stack_usage (number)]
+ */
+static int
+thread_stack (lua_State *L)
+{
+  struct sys_thread *td = checkudata(L, 1, THREAD_TYPENAME);
+  const size_t guard_size = thread_guard_size(td);
+  size_t stack_peak = td->stack_peak;
+
+#ifdef USE_STACK_PEAK
+  if (td->stack_high && td == sys_thread_get())
+    stack_peak = thread_stack_peak(td);
+#endif
+
+  lua_pushinteger(L, (lua_Integer) thread_stack_size(td));
+  if (guard_size != THREAD_GUARD_DEFAULT)
+    lua_pushinteger(L, (lua_Integer) guard_size);
+  else
+    lua_pushnil(L);
+  if (!stack_peak) return 2;
+  lua_pushinteger(L, (lua_Integer) stack_peak);
+  return 3;
+}
+
 /*
  * Arguments: thread_udata
  * Returns: string
@@ -1129,9 +1517,12 @@ thread_tostring (lua_State *L)
 }
 
 
-#include "thread_dpool.c"
 #include "thread_pipe.c"
+#include "thread_chan.c"
+#include "thread_dpool.c"
 #include "thread_sched.c"
+#include "thread_snap.c"
+#include "thread_vmpool.c"
 
 
 static luaL_Reg thread_meth[] = {
@@ -1140,6 +1531,7 @@ static luaL_Reg thread_meth[] = {
   {"interrupt",		thread_set_interrupt},
   {"terminate",		thread_set_terminate},
   {"wait",		thread_wait},
+  {"stack",		thread_stack},
   {"__tostring",	thread_tostring},
   {"__gc",		thread_done},
   THREAD_SCHED_METHODS,
@@ -1151,15 +1543,19 @@ static luaL_Reg thread_lib[] = {
   {"runvm",		thread_runvm},
   {"run",		thread_run},
   {"self",		thread_self},
+  {"vmlock",		thread_vmlock},
   {"sleep",		thread_sleep},
   {"switch",		thread_switch_wrap},
   {"yield",		thread_yield},
   {"suspend",		thread_suspend_wrap},
   {"interrupt_error",	thread_interrupt_error},
   AFFIN_METHODS,
+  CHAN_METHODS,
   DPOOL_METHODS,
   PIPE_METHODS,
   SCHED_METHODS,
+  SNAP_METHODS,
+  VMPOOL_METHODS,
   {NULL, NULL}
 };
 
@@ -1172,9 +1568,12 @@ thread_createmeta (lua_State *L)
     luaL_Reg *meth;
   } meta[] = {
     {THREAD_TYPENAME,	thread_meth},
+    {CHAN_TYPENAME,	chan_meth},
     {DPOOL_TYPENAME,	dpool_meth},
     {PIPE_TYPENAME,	pipe_meth},
     {SCHED_TYPENAME,	sched_meth},
+    {SNAP_TYPENAME,	snap_meth},
+    {VMPOOL_TYPENAME,	vmpool_meth},
   };
   int i;
 
@@ -2,6 +2,9 @@
 
 #if defined(__linux__)
 
+#include <dirent.h>
+#include <stdio.h>
+
 typedef cpu_set_t	affin_mask_t;
 
 #define USE_PTHREAD_AFFIN
@@ -38,6 +41,7 @@ typedef cpuset_t	affin_mask_t;
 #define CPU_SIZEOF(p)	cpuset_size(p)
 #define CPU_ZERO(p)	cpuset_zero(p)
 #define CPU_SET(i,p)	cpuset_set(i, p)
+#define CPU_CLR(i,p)	cpuset_clr(i, p)
 #define CPU_ISSET(i,p)	(cpuset_isset(i, p) > 0)
 
 #else  /* _WIN32 */
@@ -49,6 +53,7 @@ typedef size_t		affin_mask_t;
 #define CPU_SIZEOF(p)	sizeof(affin_mask_t)
 #define CPU_ZERO(p)	(*(p) = 0)
 #define CPU_SET(i,p)	(*(p) |= ((affin_mask_t) 1 << (i)))
+#define CPU_CLR(i,p)	(*(p) &= ~((affin_mask_t) 1 << (i)))
 #define CPU_ISSET(i,p)	((*(p) & ((affin_mask_t) 1 << (i))) != 0)
 
 #endif
@@ -144,6 +149,332 @@ affin_cpu_set (thread_id_t tid, int cpu)
   return res;
 }
 
+static int
+affin_mask_set (thread_id_t tid, affin_mask_t *mp)
+{
+#if defined(USE_PTHREAD_AFFIN)
+  const int res = pthread_setaffinity_np(tid, CPU_SIZEOF(mp), mp);
+  if (res) errno = res;
+  return res;
+#elif defined(_WIN32)
+  return (SetThreadAffinityMask(tid, *mp) > 0) ? 0 : -1;
+#else
+  (void) tid;
+  (void) mp;
+
+  return -1;
+#endif
+}
+
+static affin_mask_t *
+affin_mask_dup (affin_mask_t *mp)
+{
+  affin_mask_t *dup = mp ? CPU_NEW() : NULL;
+
+  if (dup) memcpy(dup, mp, CPU_SIZEOF(mp));
+  return dup;
+}
+
+#define affin_mask_del(mp)	CPU_DEL(mp)
+
+
+/* NUMA Topology */
+#if defined(__linux__)
+
+#define AFFIN_SYSFS_CPU		"/sys/devices/system/cpu/cpu"
+#define AFFIN_SYSFS_NODE	"/sys/devices/system/node/node"
+
+static int
+affin_sysfs_read (const char *path, char *buf, const size_t len)
+{
+  const int fd = open(path, O_RDONLY);
+  int n;
+
+  if (fd == -1) return -1;
+  n = read(fd, buf, len - 1);
+  close(fd);
+
+  if (n < 0) return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+static int
+affin_sysfs_int (const char *prefix, const int id, const char *name)
+{
+  char path[128], buf[32];
+
+  sprintf(path, "%s%d/%s", prefix, id, name);
+  return (affin_sysfs_read(path, buf, sizeof(buf)) > 0) ? atoi(buf) : -1;
+}
+
+static int
+affin_cpu_node (const int cpu)
+{
+  char path[64];
+  struct dirent *entry;
+  DIR *dir;
+  int node = -1;
+
+  sprintf(path, AFFIN_SYSFS_CPU "%d", cpu);
+  dir = opendir(path);
+  if (!dir) return -1;
+
+  while ((entry = readdir(dir))) {
+    const char *name = entry->d_name;
+
+    if (!strncmp(name, "node", 4) && name[4] >= '0' && name[4] <= '9') {
+      node = atoi(name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/*
+ * Parse the CPUs list (e.g. "0-3,8-11").
+ */
+static void
+affin_cpulist_parse (const char *s, affin_mask_t *mp)
+{
+  CPU_ZERO(mp);
+  while (*s >= '0' && *s <= '9') {
+    char *end;
+    const int from = (int) strtol(s, &end, 10);
+    int i, to = from;
+
+    if (*end == '-')
+      to = (int) strtol(end + 1, &end, 10);
+
+    for (i = from; i <= to && i < (int) CPU_COUNTMAX(mp); ++i)
+      CPU_SET(i, mp);
+
+    s = (*end == ',') ? end + 1 : end;
+  }
+}
+
+static int
+affin_node_fill (const int node, affin_mask_t *mp)
+{
+  char path[64], buf[1024];
+
+  sprintf(path, AFFIN_SYSFS_NODE "%d/cpulist", node);
+  if (affin_sysfs_read(path, buf, sizeof(buf)) <= 0)
+    return -1;
+
+  affin_cpulist_parse(buf, mp);
+  return 0;
+}
+
+/*
+ * Get the hardware threads (SMT siblings) of the CPU's core.
+ */
+static int
+affin_cpu_siblings (const int cpu, affin_mask_t *mp)
+{
+  char path[128], buf[1024];
+
+  sprintf(path, AFFIN_SYSFS_CPU "%d/topology/thread_siblings_list", cpu);
+  if (affin_sysfs_read(path, buf, sizeof(buf)) <= 0)
+    return -1;
+
+  affin_cpulist_parse(buf, mp);
+  return 0;
+}
+
+#elif defined(_WIN32)
+
+#define affin_sysfs_int(prefix,id,name)	(-1)
+#define affin_cpu_siblings(cpu,mp)	(-1)
+
+static int
+affin_cpu_node (const int cpu)
+{
+  UCHAR node;
+
+  return GetNumaProcessorNode((UCHAR) cpu, &node) ? node : -1;
+}
+
+static int
+affin_node_fill (const int node, affin_mask_t *mp)
+{
+  ULONGLONG mask;
+
+  if (!GetNumaNodeProcessorMask((UCHAR) node, &mask))
+    return -1;
+  *mp = (affin_mask_t) mask;
+  return 0;
+}
+
+#else
+
+#define affin_sysfs_int(prefix,id,name)	(-1)
+#define affin_cpu_node(cpu)		(-1)
+#define affin_cpu_siblings(cpu,mp)	(-1)
+
+static int
+affin_node_fill (const int node, affin_mask_t *mp)
+{
+  (void) node;
+  (void) mp;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+/*
+ * Arguments: ..., options (table: {cpus = {1..n: number}, node = number}), ...
+ * Returns: [mask (nil: options are absent)]
+ *
+ * CPUs are 1-based offsets in the process's allowed set, as the "cpu"
+ * option and the "cpu" field of thread.topology(), not system ids.
+ */
+static affin_mask_t *
+affin_mask_opt (lua_State *L, const int idx)
+{
+  affin_mask_t *mp = NULL, *allowed = NULL;
+  const char *errmsg = NULL;
+  int node;
+
+  lua_getfield(L, idx, "node");
+  node = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : -1;
+  lua_getfield(L, idx, "cpus");
+  if (!lua_istable(L, -1) && node == -1) {
+    lua_pop(L, 2);
+    return NULL;
+  }
+
+  mp = CPU_NEW();
+  allowed = CPU_NEW();
+  if (!mp || !allowed || affin_cpu_fill(allowed))
+    goto err;
+
+  if (lua_istable(L, -1)) {
+    int i;
+
+    CPU_ZERO(mp);
+    for (i = 1; ; ++i) {
+      int cpu_off;
+
+      lua_rawgeti(L, -1, i);
+      if (lua_isnil(L, -1)) break;
+      cpu_off = affin_cpu_offset((int) lua_tointeger(L, -1), allowed);
+      lua_pop(L, 1);
+
+      if (cpu_off == -1) {
+        errmsg = "invalid CPU";
+        goto err;
+      }
+      CPU_SET(cpu_off, mp);
+    }
+    lua_pop(L, 1);
+  } else {
+    memcpy(mp, allowed, CPU_SIZEOF(allowed));
+  }
+
+  if (node != -1) {
+    const unsigned int nmax = CPU_COUNTMAX(mp);
+    unsigned int i;
+
+    if (affin_node_fill(node, allowed)) {
+      errmsg = "invalid NUMA node";
+      goto err;
+    }
+    for (i = 0; i < nmax; ++i) {
+      if (CPU_ISSET(i, mp) && !CPU_ISSET(i, allowed))
+        CPU_CLR(i, mp);
+    }
+  }
+  if (!CPU_COUNT(mp)) {
+    errmsg = "no CPUs to bind";
+    goto err;
+  }
+
+  lua_pop(L, 2);
+  CPU_DEL(allowed);
+  return mp;
+ err:
+  if (mp) CPU_DEL(mp);
+  if (allowed) CPU_DEL(allowed);
+  if (!errmsg) errmsg = strerror(errno);
+  luaL_argerror(L, idx, errmsg);
+  return NULL;
+}
+
+/*
+ * Returns: [processors (table: {1..n: {cpu = number, id = number,
+ *	core = number, package = number, node = number,
+ *	siblings = {1..n: number}}})]
+ *
+ * "cpu" is the offset for "cpu"/"cpus" placement options (the entry's
+ * index), "id" is the system's processor number.  Siblings are offsets
+ * of the allowed hardware threads sharing the core.
+ */
+static int
+affin_topology (lua_State *L)
+{
+  affin_mask_t *mp = CPU_NEW();
+  affin_mask_t *sibs = CPU_NEW();
+  unsigned int nmax, i;
+  int n = 0;
+
+  if (!mp || !sibs || affin_cpu_fill(mp)) {
+    if (mp) CPU_DEL(mp);
+    if (sibs) CPU_DEL(sibs);
+    goto err;
+  }
+
+  lua_newtable(L);
+  nmax = CPU_COUNTMAX(mp);
+  for (i = 0; i < nmax; ++i) {
+    int v;
+
+    if (!CPU_ISSET(i, mp)) continue;
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, n + 1);
+    lua_setfield(L, -2, "cpu");
+    lua_pushinteger(L, i);
+    lua_setfield(L, -2, "id");
+    if ((v = affin_sysfs_int(AFFIN_SYSFS_CPU, i, "topology/core_id")) != -1) {
+      lua_pushinteger(L, v);
+      lua_setfield(L, -2, "core");
+    }
+    if ((v = affin_sysfs_int(AFFIN_SYSFS_CPU, i,
+     "topology/physical_package_id")) != -1) {
+      lua_pushinteger(L, v);
+      lua_setfield(L, -2, "package");
+    }
+    if ((v = affin_cpu_node(i)) != -1) {
+      lua_pushinteger(L, v);
+      lua_setfield(L, -2, "node");
+    }
+    if (!affin_cpu_siblings(i, sibs)) {
+      unsigned int j;
+      int k = 0, off = 0;
+
+      lua_newtable(L);
+      for (j = 0; j < nmax; ++j) {
+        if (!CPU_ISSET(j, mp)) continue;
+        ++off;
+        if (!CPU_ISSET(j, sibs)) continue;
+        lua_pushinteger(L, off);
+        lua_rawseti(L, -2, ++k);
+      }
+      lua_setfield(L, -2, "siblings");
+    }
+    lua_rawseti(L, -2, ++n);
+  }
+  CPU_DEL(mp);
+  CPU_DEL(sibs);
+  return 1;
+ err:
+  return sys_seterror(L, 0);
+}
+
 /*
  * Returns: [number_of_processors (number)]
  */
@@ -166,4 +497,5 @@ affin_nprocs (lua_State *L)
 
 
 #define AFFIN_METHODS \
-  {"nprocs",	affin_nprocs}
+  {"nprocs",	affin_nprocs}, \
+  {"topology",	affin_topology}
@@ -4,6 +4,14 @@
 
 #define USE_MACH_AFFIN
 
+/* CPU sets are not supported */
+typedef struct affin_mask	affin_mask_t;
+
+#define affin_mask_opt(L,idx)	((void) (L), (void) (idx), (affin_mask_t *) NULL)
+#define affin_mask_dup(mp)	((void) (mp), (affin_mask_t *) NULL)
+#define affin_mask_del(mp)	((void) (mp))
+#define affin_mask_set(tid,mp)	((void) (tid), (void) (mp), -1)
+
 
 static int
 affin_cpu_set (mach_port_t tid, int cpu)
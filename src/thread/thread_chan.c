@@ -0,0 +1,419 @@
+/* Lua System: Threading: Channels (VM-threads IPC with selection) */
+
+#define CHAN_TYPENAME	"sys.thread.channel"
+
+/* Waiting thread's registration in channel */
+struct chan_wait {
+  struct chan_wait *next;
+  thread_event_t *tev;
+};
+
+struct chan_msg {
+  struct chan_msg *next;
+  struct message msg;  /* variable size */
+};
+
+struct chan {
+  thread_critsect_t cs;  /* guard access to channel */
+
+  struct chan_msg *head, *tail;  /* queue of messages */
+  unsigned int nmsg;  /* number of messages */
+  unsigned int max;  /* maximum number of messages (0: unlimited) */
+
+  struct chan_wait *getters;  /* waiting readers */
+  struct chan_wait *putters;  /* waiting writers */
+
+  unsigned int closed:	1;  /* no more messages will be put */
+
+  unsigned int nref;
+};
+
+#define chan_isfull(ch)		((ch)->max && (ch)->nmsg >= (ch)->max)
+
+
+static void
+chan_wait_add (struct chan_wait **waitp, struct chan_wait *w)
+{
+  w->next = *waitp;
+  *waitp = w;
+}
+
+static void
+chan_wait_del (struct chan_wait **waitp, struct chan_wait *w)
+{
+  for (; *waitp; waitp = &(*waitp)->next) {
+    if (*waitp == w) {
+      *waitp = w->next;
+      break;
+    }
+  }
+}
+
+/*
+ * Wake up all waiting threads (guarded by ch->cs).
+ */
+static void
+chan_wait_signal (struct chan_wait *w)
+{
+  for (; w; w = w->next)
+    (void) thread_event_signal(w->tev);
+}
+
+/*
+ * Returns: thread's event to wait on channels
+ */
+static thread_event_t *
+chan_thread_event (lua_State *L, struct sys_thread *td)
+{
+  if (!td) luaL_argerror(L, 0, "Threading not initialized");
+
+  if (!td->chan_tev) {
+    thread_event_t *tev = malloc(sizeof(thread_event_t));
+
+    if (!tev || thread_event_new(tev)) {
+      free(tev);
+      luaL_error(L, "cannot create event");
+    }
+    td->chan_tev = tev;
+  }
+  return td->chan_tev;
+}
+
+
+/*
+ * Arguments: [max_count (number)]
+ * Returns: [channel_udata]
+ */
+static int
+chan_new (lua_State *L)
+{
+  const unsigned int max = (unsigned int) luaL_optinteger(L, 1, 0);
+  struct chan **chp = lua_newuserdata(L, sizeof(void *));
+  struct chan *ch;
+
+  *chp = NULL;
+  luaL_getmetatable(L, CHAN_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  ch = calloc(1, sizeof(struct chan));
+  if (!ch) goto err;
+
+  if (thread_critsect_new(&ch->cs)) {
+    free(ch);
+    goto err;
+  }
+  ch->max = max;
+  *chp = ch;
+  return 1;
+ err:
+  return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: channel_udata, dest. thread (ludata)
+ */
+static int
+chan_xdup (lua_State *L)
+{
+  struct chan *ch = lua_unboxpointer(L, 1, CHAN_TYPENAME);
+  lua_State *L2 = (lua_State *) lua_touserdata(L, 2);
+
+  if (!L2) luaL_argerror(L, 2, "VM-thread expected");
+
+  lua_boxpointer(L2, ch);
+  luaL_getmetatable(L2, CHAN_TYPENAME);
+  lua_setmetatable(L2, -2);
+
+  thread_critsect_enter(&ch->cs);
+  ch->nref++;
+  thread_critsect_leave(&ch->cs);
+  return 0;
+}
+
+/*
+ * Arguments: channel_udata
+ */
+static int
+chan_done (lua_State *L)
+{
+  struct chan **chp = checkudata(L, 1, CHAN_TYPENAME);
+  struct chan *ch = *chp;
+
+  if (ch) {
+    int nref;
+
+    thread_critsect_enter(&ch->cs);
+    nref = ch->nref--;
+    thread_critsect_leave(&ch->cs);
+
+    if (!nref) {
+      struct chan_msg *node = ch->head;
+
+      while (node) {
+        struct chan_msg *next = node->next;
+        free(node);
+        node = next;
+      }
+      (void) thread_critsect_del(&ch->cs);
+      free(ch);
+    }
+    *chp = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Arguments: channel_udata
+ */
+static int
+chan_close (lua_State *L)
+{
+  struct chan *ch = lua_unboxpointer(L, 1, CHAN_TYPENAME);
+
+  thread_critsect_enter(&ch->cs);
+  ch->closed = 1;
+  chan_wait_signal(ch->getters);
+  chan_wait_signal(ch->putters);
+  thread_critsect_leave(&ch->cs);
+  return 0;
+}
+
+/*
+ * Arguments: channel_udata, message_items (any) ...
+ * Returns: [channel_udata]
+ */
+static int
+chan_put (lua_State *L)
+{
+  struct sys_thread *td = sys_thread_get();
+  struct chan *ch = lua_unboxpointer(L, 1, CHAN_TYPENAME);
+  thread_event_t *tev = chan_thread_event(L, td);
+  thread_critsect_t *csp = &ch->cs;
+  struct chan_msg *node;
+  struct message msg;
+  int res = 0, closed;
+
+  if (lua_gettop(L) < 2) luaL_argerror(L, 2, "data expected");
+
+  pipe_msg_build(L, &msg, 2);  /* construct the message */
+
+  node = malloc(offsetof(struct chan_msg, msg) + msg.size);
+  if (!node) return sys_seterror(L, 0);
+  node->next = NULL;
+  memcpy(&node->msg, &msg, msg.size);
+
+  thread_critsect_enter(csp);
+  while (chan_isfull(ch) && !ch->closed) {
+    struct chan_wait w;
+
+    w.tev = tev;
+    chan_wait_add(&ch->putters, &w);
+    thread_critsect_leave(csp);
+
+    res = thread_event_wait(tev, td, TIMEOUT_INFINITE);
+
+    thread_critsect_enter(csp);
+    chan_wait_del(&ch->putters, &w);
+    if (res) break;
+  }
+  closed = ch->closed;
+  if (!res && !closed && !chan_isfull(ch)) {
+    if (ch->tail)
+      ch->tail->next = node;
+    else
+      ch->head = node;
+    ch->tail = node;
+    ch->nmsg++;
+    node = NULL;
+
+    chan_wait_signal(ch->getters);
+  }
+  thread_critsect_leave(csp);
+
+  if (node) {
+    free(node);
+
+    sys_thread_check(td, L);
+    if (closed) luaL_argerror(L, 1, "closed");
+    return sys_seterror(L, 0);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+ * Wait for message on any of channels.
+ * Arguments: ..., channel_udata ...
+ * Returns: [channel_udata | timedout (false), message_items (any) ...]
+ */
+static int
+chan_select (lua_State *L, const int idx, const int nch,
+             const msec_t timeout)
+{
+  struct sys_thread *td = sys_thread_get();
+  thread_event_t *tev = chan_thread_event(L, td);
+  const msec_t deadline = (timeout == TIMEOUT_INFINITE)
+   ? 0 : sys_milliseconds() + timeout;
+  struct chan_wait *waits = lua_newuserdata(L, nch * sizeof(struct chan_wait));
+  struct chan_msg *node = NULL;
+  int i, nregs = 0, ready = -1, res = 0;
+
+  for (; ; ) {
+    msec_t left = TIMEOUT_INFINITE;
+
+    for (i = 0; i < nch; ++i) {
+      struct chan *ch = *((struct chan **) lua_touserdata(L, idx + i));
+      thread_critsect_t *csp = &ch->cs;
+      int closed;
+
+      thread_critsect_enter(csp);
+      closed = ch->closed;
+      node = ch->head;
+      if (node) {
+        ch->head = node->next;
+        if (!ch->head) ch->tail = NULL;
+        ch->nmsg--;
+
+        chan_wait_signal(ch->putters);
+      } else if (!closed && i >= nregs) {
+        waits[i].tev = tev;
+        chan_wait_add(&ch->getters, &waits[i]);
+      }
+      thread_critsect_leave(csp);
+
+      if (node || closed) {
+        ready = i;
+        break;
+      }
+    }
+    if (i > nregs) nregs = i;
+    if (ready >= 0) break;
+
+    if (timeout != TIMEOUT_INFINITE) {
+      left = deadline - sys_milliseconds();
+      if (left <= 0) {
+        res = 1;  /* timed out */
+        break;
+      }
+    }
+    res = thread_event_wait(tev, td, left);
+    if (res) break;
+  }
+
+  /* unregister from channels */
+  for (i = 0; i < nregs; ++i) {
+    struct chan *ch = *((struct chan **) lua_touserdata(L, idx + i));
+
+    thread_critsect_enter(&ch->cs);
+    chan_wait_del(&ch->getters, &waits[i]);
+    thread_critsect_leave(&ch->cs);
+  }
+
+  if (ready < 0) {
+    sys_thread_check(td, L);
+    if (res == 1) {
+      lua_pushboolean(L, 0);
+      return 1;  /* timed out */
+    }
+    return sys_seterror(L, 0);
+  }
+
+  lua_pushvalue(L, idx + ready);
+  if (node) {
+    struct message msg;
+
+    memcpy(&msg, &node->msg, node->msg.size);
+    free(node);
+    return 1 + pipe_msg_parse(L, &msg);  /* deconstruct the message */
+  }
+  return 1;  /* closed */
+}
+
+/*
+ * Arguments: channel_udata, [timeout (milliseconds)]
+ * Returns: [channel_udata | timedout (false), message_items (any) ...]
+ */
+static int
+chan_get (lua_State *L)
+{
+  const msec_t timeout = lua_isnoneornil(L, 2)
+   ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
+
+  (void) checkudata(L, 1, CHAN_TYPENAME);
+  return chan_select(L, 1, 1, timeout);
+}
+
+/*
+ * Arguments: channels (table), [timeout (milliseconds)]
+ * Returns: [channel_udata | timedout (false), message_items (any) ...]
+ */
+static int
+chan_select_wrap (lua_State *L)
+{
+  const msec_t timeout = lua_isnoneornil(L, 2)
+   ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
+  int i, nch;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  nch = (int) lua_rawlen(L, 1);
+  if (!nch) luaL_argerror(L, 1, "channels expected");
+
+  lua_settop(L, 1);
+  luaL_checkstack(L, nch + LUA_MINSTACK, "too many channels");
+  luaL_getmetatable(L, CHAN_TYPENAME);
+
+  for (i = 1; i <= nch; ++i) {
+    lua_rawgeti(L, 1, i);
+    if (!lua_getmetatable(L, -1) || !lua_rawequal(L, 2, -1))
+      luaL_argerror(L, 1, "channels expected");
+    lua_pop(L, 1);
+  }
+  return chan_select(L, 3, nch, timeout);
+}
+
+/*
+ * Arguments: channel_udata
+ * Returns: number
+ */
+static int
+chan_count (lua_State *L)
+{
+  struct chan *ch = lua_unboxpointer(L, 1, CHAN_TYPENAME);
+  unsigned int nmsg;
+
+  thread_critsect_enter(&ch->cs);
+  nmsg = ch->nmsg;
+  thread_critsect_leave(&ch->cs);
+
+  lua_pushinteger(L, nmsg);
+  return 1;
+}
+
+/*
+ * Arguments: channel_udata
+ * Returns: string
+ */
+static int
+chan_tostring (lua_State *L)
+{
+  struct chan *ch = lua_unboxpointer(L, 1, CHAN_TYPENAME);
+
+  lua_pushfstring(L, CHAN_TYPENAME " (%p)", ch);
+  return 1;
+}
+
+
+#define CHAN_METHODS \
+  {"channel",		chan_new}, \
+  {"select",		chan_select_wrap}
+
+static luaL_Reg chan_meth[] = {
+  {THREAD_XDUP_TAG,	chan_xdup},
+  {"put",		chan_put},
+  {"get",		chan_get},
+  {"close",		chan_close},
+  {"__len",		chan_count},
+  {"__tostring",	chan_tostring},
+  {"__gc",		chan_done},
+  {NULL, NULL}
+};
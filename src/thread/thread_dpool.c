@@ -2,6 +2,8 @@
 
 #define DPOOL_TYPENAME	"sys.thread.data_pool"
 
+#define DPOOL_RING_MINSIZE	(2 * sizeof(struct message))
+
 struct data_pool {
   unsigned int volatile n;  /* count of data in storage */
 
@@ -17,20 +19,95 @@ struct data_pool {
 #define DPOOL_OPEN		4
   unsigned int flags;
 
+  /* native storage: ring of messages */
+  char *ring;
+  unsigned int ring_mask;  /* size of ring - 1 */
+  unsigned int rpos, wpos;  /* read/write counters */
+  int volatile ring_waits;  /* number of writers waiting for space */
+  thread_event_t ring_tev;  /* space in ring is freed */
+
   thread_event_t tev;  /* synchronization */
 };
 
+#define dpool_ring_free(dp) \
+    ((dp)->ring_mask + 1 - ((dp)->wpos - (dp)->rpos))
+
+
+static void
+dpool_ring_write (struct data_pool *dp, const char *p, const unsigned int len)
+{
+  const unsigned int off = dp->wpos & dp->ring_mask;
+  const unsigned int n = dp->ring_mask + 1 - off;
+
+  if (len <= n)
+    memcpy(dp->ring + off, p, len);
+  else {
+    memcpy(dp->ring + off, p, n);
+    memcpy(dp->ring, p + n, len - n);
+  }
+  dp->wpos += len;
+}
+
+static void
+dpool_ring_read (struct data_pool *dp, char *p, const unsigned int len)
+{
+  const unsigned int off = dp->rpos & dp->ring_mask;
+  const unsigned int n = dp->ring_mask + 1 - off;
+
+  if (len <= n)
+    memcpy(p, dp->ring + off, len);
+  else {
+    memcpy(p, dp->ring + off, n);
+    memcpy(p + n, dp->ring, len - n);
+  }
+  dp->rpos += len;
+}
+
+
+/*
+ * Native storage keeps userdata as pointer only: reject full userdata,
+ * which could be collected while stored.
+ */
+static void
+dpool_ring_check (lua_State *L, const int idx)
+{
+  const int top = lua_gettop(L);
+  int i;
+
+  for (i = idx; i <= top; ++i) {
+    if (lua_type(L, i) == LUA_TUSERDATA)
+      luaL_argerror(L, i - idx + 2, "full userdata in native storage");
+  }
+}
+
 
 /*
+ * Arguments: [native_storage_size (number)]
  * Returns: [dpool_udata]
  */
 static int
 dpool_new (lua_State *L)
 {
+  const unsigned int ring_size = (unsigned int) luaL_optinteger(L, 1, 0);
   struct data_pool *dp = lua_newuserdata(L, sizeof(struct data_pool));
   memset(dp, 0, sizeof(struct data_pool));
   dp->max = (unsigned int) -1;
 
+  if (ring_size) {
+    unsigned int size = 1;
+
+    while (size < ring_size || size < DPOOL_RING_MINSIZE)
+      size <<= 1;
+    dp->ring = malloc(size);
+    if (!dp->ring) goto err;
+    if (thread_event_new(&dp->ring_tev)) {
+      free(dp->ring);
+      dp->ring = NULL;
+      goto err;
+    }
+    dp->ring_mask = size - 1;
+  }
+
   if (!thread_event_new(&dp->tev)) {
     dp->flags |= DPOOL_OPEN;
     luaL_getmetatable(L, DPOOL_TYPENAME);
@@ -40,6 +117,12 @@ dpool_new (lua_State *L)
     lua_setfenv(L, -2);
     return 1;
   }
+  if (dp->ring) {
+    thread_event_del(&dp->ring_tev);
+    free(dp->ring);
+    dp->ring = NULL;
+  }
+ err:
   return sys_seterror(L, 0);
 }
 
@@ -55,6 +138,11 @@ dpool_close (lua_State *L)
     dp->flags ^= DPOOL_OPEN;
     thread_event_del(&dp->tev);
   }
+  if (dp->ring) {
+    thread_event_del(&dp->ring_tev);
+    free(dp->ring);
+    dp->ring = NULL;
+  }
   return 0;
 }
 
@@ -74,6 +162,8 @@ dpool_put (lua_State *L)
   lua_getfenv(L, 1);  /* storage */
   lua_insert(L, 1);
 
+  if (dp->ring) dpool_ring_check(L, 3);
+
   if (dp->n >= dp->max) {
     if (dp->flags & DPOOL_PUTONFULL) {
       lua_rawgetp(L, 1, (void *) DPOOL_PUTONFULL);
@@ -81,6 +171,7 @@ dpool_put (lua_State *L)
       lua_call(L, 1 + nput, LUA_MULTRET);
       nput = lua_gettop(L) - 1;
       if (!nput) return 0;
+      if (dp->ring) dpool_ring_check(L, 2);
     } else {
       do {
         const int res = thread_event_wait(&dp->tev, td,
@@ -92,6 +183,31 @@ dpool_put (lua_State *L)
     }
   }
 
+  /* Keep data in the native storage */
+  if (dp->ring) {
+    struct message msg;
+
+    pipe_msg_build(L, &msg, lua_gettop(L) - nput + 1);
+
+    while (dpool_ring_free(dp) < msg.size) {
+      int res;
+
+      dp->ring_waits++;
+      res = thread_event_wait(&dp->ring_tev, td, TIMEOUT_INFINITE);
+      dp->ring_waits--;
+
+      sys_thread_check(td, L);
+      if (res) return sys_seterror(L, 0);
+    }
+
+    dpool_ring_write(dp, (const char *) &msg, msg.size);
+
+    if (!dp->n++ || dp->nwaits) {
+      thread_event_signal(&dp->tev);
+    }
+    return 0;
+  }
+
   /* Try directly move data between threads */
   if (dp->nwaits && !dp->L) {
     dp->L = L;
@@ -121,16 +237,70 @@ dpool_put (lua_State *L)
 }
 
 /*
- * Arguments: dpool_udata, [timeout (milliseconds)]
+ * Arguments: storage (table), ...
  * Returns: data_items (any) ...
  */
 static int
-dpool_get (lua_State *L)
+dpool_pop (lua_State *L, struct data_pool *dp)
+{
+  int nput;
+
+  if (dp->ring) {
+    struct message msg;
+
+    dpool_ring_read(dp, (char *) &msg.size, sizeof(msg.size));
+    dpool_ring_read(dp, msg.items,
+     msg.size - offsetof(struct message, items));
+    nput = pipe_msg_parse(L, &msg);
+
+    if (dp->ring_waits) {
+      thread_event_signal(&dp->ring_tev);
+    }
+  } else {
+    const int idx = dp->idx + 1;
+    int i;
+
+    lua_rawgeti(L, 1, idx);
+    nput = (int) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, 1, idx);
+    luaL_checkstack(L, nput, "too many data items");
+
+    dp->idx = idx + nput;
+    for (i = dp->idx; i > idx; --i) {
+      lua_rawgeti(L, 1, i);
+      lua_pushnil(L);
+      lua_rawseti(L, 1, i);
+    }
+    if (dp->idx == dp->top)
+      dp->idx = dp->top = 0;
+  }
+
+  if (dp->n-- == dp->max) {
+    thread_event_signal(&dp->tev);
+  }
+  return nput;
+}
+
+/*
+ * Prefix the data items with their count.
+ */
+static int
+dpool_push_count (lua_State *L, const int nput)
+{
+  luaL_checkstack(L, 1, "too many data items");
+  lua_pushinteger(L, nput);
+  lua_insert(L, -nput - 1);
+  return nput + 1;
+}
+
+static int
+dpool_get_items (lua_State *L, int nmax, const int counts,
+                 const msec_t timeout)
 {
   struct sys_thread *td = sys_thread_get();
   struct data_pool *dp = checkudata(L, 1, DPOOL_TYPENAME);
-  const msec_t timeout = lua_isnoneornil(L, 2)
-   ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
   int nput;
 
   if (!td) luaL_argerror(L, 0, "Threading not initialized");
@@ -144,31 +314,14 @@ dpool_get (lua_State *L)
     lua_insert(L, 2);
     lua_call(L, 1, LUA_MULTRET);
     nput = lua_gettop(L) - 1;
-    if (nput) return nput;
+    if (nput) return counts ? dpool_push_count(L, nput) : nput;
   }
 
   for (; ; ) {
     /* get from storage */
     if (dp->n) {
-      const int idx = dp->idx + 1;
-      int i;
-
-      lua_rawgeti(L, 1, idx);
-      nput = (int) lua_tointeger(L, -1);
-      lua_pushnil(L);
-      lua_rawseti(L, 1, idx);
-      dp->idx = idx + nput;
-      for (i = dp->idx; i > idx; --i) {
-        lua_rawgeti(L, 1, i);
-        lua_pushnil(L);
-        lua_rawseti(L, 1, i);
-      }
-      if (dp->idx == dp->top)
-        dp->idx = dp->top = 0;
-      if (dp->n-- == dp->max) {
-        thread_event_signal(&dp->tev);
-      }
-      return nput;
+      nput = dpool_pop(L, dp);
+      break;
     }
 
     /* wait signal */
@@ -195,9 +348,49 @@ dpool_get (lua_State *L)
       luaL_checkstack(L, nput, NULL);
       lua_xmove(dp->L, L, nput);
       dp->nput = 0;
-      return nput;
+      break;
     }
   }
+
+  if (counts) nput = dpool_push_count(L, nput);
+
+  /* batch of already stored data */
+  while (--nmax > 0 && dp->n) {
+    const int n = dpool_pop(L, dp);
+
+    nput += counts ? dpool_push_count(L, n) : n;
+  }
+  return nput;
+}
+
+/*
+ * Arguments: dpool_udata, [timeout (milliseconds)]
+ * Returns: data_items (any) ...
+ */
+static int
+dpool_get (lua_State *L)
+{
+  const msec_t timeout = lua_isnoneornil(L, 2)
+   ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 2);
+
+  return dpool_get_items(L, 1, 0, timeout);
+}
+
+/*
+ * Arguments: dpool_udata, maximum_count (number), [timeout (milliseconds)]
+ * Returns: count (number), data_items (any) ... [, count, data_items ...]
+ *	| timedout (false)
+ */
+static int
+dpool_get_many (lua_State *L)
+{
+  const int nmax = luaL_checkint(L, 2);
+  const msec_t timeout = lua_isnoneornil(L, 3)
+   ? TIMEOUT_INFINITE : (msec_t) lua_tointeger(L, 3);
+
+  if (nmax <= 0) luaL_argerror(L, 2, "positive count expected");
+
+  return dpool_get_items(L, nmax, 1, timeout);
 }
 
 /*
@@ -275,6 +468,7 @@ dpool_tostring (lua_State *L)
 static luaL_Reg dpool_meth[] = {
   {"put",		dpool_put},
   {"get",		dpool_get},
+  {"get_many",		dpool_get_many},
   {"max",		dpool_max},
   {"callbacks",		dpool_callbacks},
   {"__len",		dpool_count},
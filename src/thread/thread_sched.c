@@ -2,9 +2,27 @@
 
 #define SCHED_TYPENAME	"sys.thread.scheduler"
 
-#define SCHED_BUF_MIN		32
+#define SCHED_CHUNK_SHIFT	8
+#define SCHED_CHUNK_SIZE	(1 << SCHED_CHUNK_SHIFT)  /* tasks per chunk */
+#define SCHED_CHUNKS_MIN	8
+#define SCHED_DEQUE_MIN		16
+#define SCHED_TIMERS_MIN	32
 #define SCHED_WORKER_TIMEOUT	3000
 
+/* Task priority classes */
+enum {
+  SCHED_PRIO_HIGH = 0,  /* latency-sensitive */
+  SCHED_PRIO_NORMAL,
+  SCHED_PRIO_LOW,  /* bulk */
+  SCHED_PRIO_COUNT
+};
+
+/* Starvation protection: serve a lower priority after skips */
+#define SCHED_PRIO_SKIPS	16
+
+/* Preemption: instructions to run before yield of the hooked task */
+#define SCHED_PREEMPT_COUNT	1000
+
 /* Scheduler coroutine reserved indexes */
 #define SCHED_CORO_ENV		1  /* environ. */
 #define SCHED_CORO_CBCOCTL	2  /* callback: coroutines controller */
@@ -14,13 +32,22 @@
 struct sched_task {
   lua_State *co;  /* coroutine */
 
-  int prev_id, next_id;  /* circular list of tasks */
+  struct sched_task *prev, *next;  /* circular list of tasks */
   void *ev_op;  /* waiting in event queue */
+  int task_id;  /* index in tasks storage */
+  int timer_idx;  /* index in sleep timers heap */
+
+  int64_t ready_at;  /* accounting: time of becoming runnable */
+  int64_t run_time;  /* accounting: cumulative run time */
 
   unsigned int started:		1;  /* execution started */
   unsigned int suspended:	1;  /* execution was suspended */
   unsigned int ev_added:	1;  /* event added to event queue */
   unsigned int terminate:	1;  /* termination requested */
+  unsigned int queued:		1;  /* in worker's deque */
+  unsigned int active:		1;  /* in active list */
+  unsigned int sleeping:	1;  /* waiting in sleep timers heap */
+  unsigned int priority:	2;  /* priority class */
 };
 
 struct scheduler {
@@ -28,20 +55,40 @@ struct scheduler {
 
   struct event_queue *evq;  /* event queue */
 
-  int active_task_id;  /* active tasks */
-  int free_task_id;  /* free tasks */
+  struct sched_task *active_tasks[SCHED_PRIO_COUNT];  /* active tasks by priority */
+  struct sched_task *free_tasks;  /* free tasks */
+
+  unsigned int prio_skips[SCHED_PRIO_COUNT];  /* times priority was skipped */
 
   unsigned int ntasks;  /* number of tasks */
+  unsigned int nactive;  /* number of tasks in active lists */
+  unsigned int nqueued;  /* number of tasks in workers' deques */
   unsigned int volatile tick;  /* yields count */
 
+  /* accounting (microseconds) */
+  int64_t busy_time;  /* time spent in tasks */
+  int64_t workers_time;  /* sum of workers' lifetime */
+  int64_t workers_at;  /* last update of workers_time */
+  int64_t wait_time, wait_max;  /* runnable tasks waiting for resume */
+  unsigned int nwaits;  /* number of measured waits */
+
   struct sched_context *ctx;  /* running context */
 
-  struct sched_task *buffer;  /* tasks buffer */
-  int buf_idx, buf_max;  /* tasks buffer current and maximum indexes */
+  struct sched_context *workers;  /* work-stealing: workers list */
+  struct sched_context *idle_workers;  /* work-stealing: parked workers */
+
+  struct sched_timer *timers;  /* sleep timers heap */
+  unsigned int ntimers, timers_max;  /* number of timers and heap size */
+
+  struct sched_task **chunks;  /* tasks storage: chunks of tasks */
+  int nchunks, chunks_max;  /* number of chunks and size of chunks array */
+  int ntotal;  /* number of allocated tasks */
 
   unsigned int stop:		1;  /* stop looping */
   unsigned int cb_coctl:	1;  /* coroutines controller exists */
   unsigned int evq_waiting:	1;  /* waiting in event queue */
+  unsigned int steal:		1;  /* work-stealing mode */
+  unsigned int accounting:	1;  /* measure tasks' timings */
 
   msec_t worker_timeout;  /* worker thread timeout */
 
@@ -51,92 +98,487 @@ struct scheduler {
   unsigned short nworkers;  /* number of worker threads */
   unsigned short nwaiters;  /* number of waiting threads */
 
+  /* preemption (guarded by g_SchedPreempt.cs) */
+  struct scheduler *preempt_next;
+  msec_t preempt_msec;  /* time slice */
+  msec_t preempt_at;  /* next check */
+  unsigned int preempt_tick;  /* yields count at last check */
+
   thread_critsect_t cs;  /* guard access to context */
   thread_cond_t cond;  /* notification */
 };
 
+/* Process-wide preemption service */
+static struct {
+  thread_critsect_t cs;
+  thread_cond_t cond;  /* schedulers list changed */
+  struct scheduler *scheds;  /* preempted schedulers */
+  int initialized, running;
+} g_SchedPreempt;
+
+static int sched_preempt_set (struct scheduler *sched, const msec_t msec);
+static void sched_preempt_tasks_hook (lua_State *L, lua_Debug *ar);
+
+struct sched_timer {
+  msec_t wake_at;  /* time to wake up */
+  struct sched_task *task;  /* sleeping task */
+};
+
 struct sched_context {
   struct scheduler *sched;
   lua_State *co;  /* running task coroutine */
-  int task_id;  /* running task */
+  struct sched_task *task;  /* running task */
+
+  /* work-stealing mode */
+  struct sched_context *next_worker, *next_idle;
+  struct sched_task **deque;  /* owner pops from tail, thieves steal from head */
+  unsigned int dq_head, dq_tail, dq_mask;
+  unsigned int idle;  /* parked */
+  thread_cond_t cond;  /* notification */
 };
 
 
 #define sched_is_empty(sched)	(!sched->ntasks)
 
+#define sched_has_ready(sched) \
+    ((sched)->nactive || (sched)->nqueued)
+
 #define sched_check_task_id(sched,task_id) \
-    (task_id >= 0 && task_id < (sched)->buf_idx)
+    (task_id >= 0 && task_id < (sched)->ntotal)
 
 #define sched_id_to_task(sched,task_id) \
-    (&(sched)->buffer[task_id])
+    (&(sched)->chunks[(task_id) >> SCHED_CHUNK_SHIFT] \
+     [(task_id) & (SCHED_CHUNK_SIZE - 1)])
 
-#define sched_task_to_id(sched,task) \
-    (int) (task - (sched)->buffer)
+#define sched_task_to_id(sched,task)	((task)->task_id)
 
-#define sched_tasklist_add(sched,list_idp,task) \
+#define sched_tasklist_add(listp,task) \
   do { \
-    const int task_id_ = sched_task_to_id(sched, task); \
-    const int head_id_ = *(list_idp); \
-    if (head_id_ != -1) { \
-      struct sched_task *head_task_ = \
-       sched_id_to_task(sched, head_id_); \
-      struct sched_task *head_prev_ = \
-       sched_id_to_task(sched, head_task_->prev_id); \
-      head_prev_->next_id = task_id_; \
-      task->prev_id = head_task_->prev_id; \
-      head_task_->prev_id = task_id_; \
-      task->next_id = head_id_; \
+    struct sched_task *head_ = *(listp); \
+    if (head_) { \
+      (task)->prev = head_->prev; \
+      (task)->next = head_; \
+      head_->prev->next = (task); \
+      head_->prev = (task); \
     } else { \
-      task->prev_id = task->next_id = task_id_; \
-      *(list_idp) = task_id_; \
+      (task)->prev = (task)->next = (task); \
+      *(listp) = (task); \
     } \
   } while (0)
 
-#define sched_tasklist_del(sched,list_idp,task) \
+#define sched_tasklist_del(listp,task) \
   do { \
-    const int task_id_ = sched_task_to_id(sched, task); \
-    if (task_id_ != task->next_id) { \
-      struct sched_task *task_prev_ = \
-       sched_id_to_task(sched, task->prev_id); \
-      struct sched_task *task_next_ = \
-       sched_id_to_task(sched, task->next_id); \
-      task_next_->prev_id = task->prev_id; \
-      task_prev_->next_id = task->next_id; \
-      if (*(list_idp) == task_id_) { \
-        *(list_idp) = task->next_id; \
+    if ((task)->next != (task)) { \
+      (task)->next->prev = (task)->prev; \
+      (task)->prev->next = (task)->next; \
+      if (*(listp) == (task)) { \
+        *(listp) = (task)->next; \
       } \
     } else { \
-      *(list_idp) = -1; \
+      *(listp) = NULL; \
     } \
   } while (0)
 
 
+/*
+ * Tasks are allocated in fixed size chunks, so task pointers stay valid
+ * when the storage grows.
+ */
 static struct sched_task *
 sched_task_alloc (struct scheduler *sched)
 {
   struct sched_task *task;
+  int task_id;
+
+  if (sched->free_tasks) {
+    task = sched->free_tasks;
+    sched_tasklist_del(&sched->free_tasks, task);
+    task_id = task->task_id;
+  } else {
+    const int chunk_idx = sched->ntotal >> SCHED_CHUNK_SHIFT;
+
+    if (chunk_idx == sched->nchunks) {
+      if (sched->nchunks == sched->chunks_max) {
+        const int newlen = sched->chunks_max
+         ? sched->chunks_max * 2 : SCHED_CHUNKS_MIN;
+        void *p = realloc(sched->chunks,
+         newlen * sizeof(struct sched_task *));
 
-  if (sched->free_task_id != -1) {
-    const int task_id = sched->free_task_id;
+        if (!p) return NULL;
+
+        sched->chunks = p;
+        sched->chunks_max = newlen;
+      }
+      task = malloc(SCHED_CHUNK_SIZE * sizeof(struct sched_task));
+      if (!task) return NULL;
+
+      sched->chunks[sched->nchunks++] = task;
+    }
+    task_id = sched->ntotal++;
     task = sched_id_to_task(sched, task_id);
-    sched_tasklist_del(sched, &sched->free_task_id, task);
+  }
+
+  memset(task, 0, sizeof(struct sched_task));
+  task->task_id = task_id;
+  return task;
+}
+
+static const char *const sched_prio_names[] = {
+  "high", "normal", "low", NULL
+};
+
+static void
+sched_active_add (struct scheduler *sched, struct sched_task *task)
+{
+  sched_tasklist_add(&sched->active_tasks[task->priority], task);
+  task->active = -1;
+  sched->nactive++;
+}
+
+static void
+sched_active_del (struct scheduler *sched, struct sched_task *task)
+{
+  sched_tasklist_del(&sched->active_tasks[task->priority], task);
+  task->active = 0;
+  sched->nactive--;
+}
+
+/*
+ * Normal priority tasks are kept in workers' deques in work-stealing mode.
+ */
+#define sched_prio_ready(sched,prio) \
+    ((sched)->active_tasks[prio] \
+     || ((prio) == SCHED_PRIO_NORMAL && (sched)->nqueued))
+
+/*
+ * Get the highest priority class of runnable tasks,
+ * but don't starve lower priorities.
+ */
+static int
+sched_prio_next (struct scheduler *sched)
+{
+  int prio, i;
+
+  if (!sched_has_ready(sched)) return -1;
+
+  for (prio = 0; !sched_prio_ready(sched, prio); ++prio)
+    continue;
+
+  for (i = SCHED_PRIO_COUNT; --i > prio; ) {
+    if (sched_prio_ready(sched, i)
+     && ++sched->prio_skips[i] >= SCHED_PRIO_SKIPS) {
+      prio = i;
+      break;
+    }
+  }
+  sched->prio_skips[prio] = 0;
+  return prio;
+}
+
+
+/*
+ * Work-stealing deque of the worker
+ */
+
+static int
+sched_deque_push (struct sched_context *sched_ctx, struct sched_task *task,
+                  const int at_head)
+{
+  const unsigned int n = sched_ctx->dq_tail - sched_ctx->dq_head;
+
+  if (!sched_ctx->deque || n > sched_ctx->dq_mask) {
+    const unsigned int newlen = sched_ctx->deque
+     ? (sched_ctx->dq_mask + 1) * 2 : SCHED_DEQUE_MIN;
+    struct sched_task **p = malloc(newlen * sizeof(struct sched_task *));
+    unsigned int i;
+
+    if (!p) return -1;
+
+    for (i = 0; i < n; ++i) {
+      p[i] = sched_ctx->deque[(sched_ctx->dq_head + i) & sched_ctx->dq_mask];
+    }
+    free(sched_ctx->deque);
+
+    sched_ctx->deque = p;
+    sched_ctx->dq_head = 0;
+    sched_ctx->dq_tail = n;
+    sched_ctx->dq_mask = newlen - 1;
+  }
+
+  if (at_head)
+    sched_ctx->deque[--sched_ctx->dq_head & sched_ctx->dq_mask] = task;
+  else
+    sched_ctx->deque[sched_ctx->dq_tail++ & sched_ctx->dq_mask] = task;
+
+  sched_ctx->sched->nqueued++;
+  return 0;
+}
+
+static struct sched_task *
+sched_deque_pop (struct sched_context *sched_ctx, const int from_head)
+{
+  if (sched_ctx->dq_head == sched_ctx->dq_tail)
+    return NULL;
+
+  sched_ctx->sched->nqueued--;
+  return from_head
+   ? sched_ctx->deque[sched_ctx->dq_head++ & sched_ctx->dq_mask]
+   : sched_ctx->deque[--sched_ctx->dq_tail & sched_ctx->dq_mask];
+}
+
+/*
+ * Steal the oldest task from other workers.
+ */
+static struct sched_task *
+sched_deque_steal (struct scheduler *sched,
+                   struct sched_context *sched_ctx)
+{
+  struct sched_context *victim = sched_ctx->next_worker;
+
+  for (; ; ) {
+    if (!victim) victim = sched->workers;
+    if (victim == sched_ctx) break;
+
+    {
+      struct sched_task *task = sched_deque_pop(victim, 1);
+      if (task) return task;
+    }
+    victim = victim->next_worker;
+  }
+  return NULL;
+}
+
+/*
+ * Wake up a waiting worker.
+ */
+static void
+sched_notify (struct scheduler *sched)
+{
+  if (sched->steal) {
+    struct sched_context *sched_ctx = sched->idle_workers;
+
+    if (sched_ctx) {
+      sched->idle_workers = sched_ctx->next_idle;
+      sched_ctx->idle = 0;
+      (void) thread_cond_signal(&sched_ctx->cond);
+    }
+  } else {
+    (void) thread_cond_signal(&sched->cond);
+  }
+}
+
+/*
+ * Make the task runnable: push it to the running worker's deque
+ * in work-stealing mode or to the active list of its priority.
+ */
+static void
+sched_task_ready (struct scheduler *sched, struct sched_task *task,
+                  const int at_head)
+{
+  struct sched_context *sched_ctx = sched->steal ? sched->ctx : NULL;
+  const int is_empty = !sched_has_ready(sched);
+
+  if (sched->accounting)
+    task->ready_at = sys_microseconds();
+
+  task->queued = 0;
+  if (sched_ctx && task->priority == SCHED_PRIO_NORMAL
+   && !sched_deque_push(sched_ctx, task, at_head)) {
+    task->queued = -1;
   } else {
-    if (sched->buf_idx == sched->buf_max) {
-      const int newlen = sched->buf_max
-       ? sched->buf_max * 2 : SCHED_BUF_MIN;
-      void *p = realloc(sched->buffer,
-       newlen * sizeof(struct sched_task));
+    sched_active_add(sched, task);
+  }
+
+  if (sched->steal ? (sched->idle_workers != NULL)
+   : (is_empty && sched->nwaiters))
+    sched_notify(sched);
+}
 
-      if (!p) return NULL;
+/*
+ * Get the next runnable task.
+ */
+static struct sched_task *
+sched_task_next (struct scheduler *sched, struct sched_context *sched_ctx)
+{
+  const int prio = sched_prio_next(sched);
+  struct sched_task *task;
+
+  if (prio < 0) return NULL;
 
-      sched->buffer = p;
-      sched->buf_max = newlen;
+  if (prio == SCHED_PRIO_NORMAL && sched->nqueued) {
+    task = sched_deque_pop(sched_ctx, 0);
+    if (!task)
+      task = sched_deque_steal(sched, sched_ctx);
+    if (task) {
+      task->queued = 0;
+      return task;
     }
-    task = sched_id_to_task(sched, sched->buf_idx++);
   }
+
+  task = sched->active_tasks[prio];
+  if (task) sched_active_del(sched, task);
   return task;
 }
 
+/*
+ * Sleep timers: binary min-heap ordered by wake up time
+ */
+
+#define sched_timer_before(a,b) \
+    ((int) ((unsigned int) (a) - (unsigned int) (b)) < 0)
+
+static void
+sched_timer_set (struct scheduler *sched, const unsigned int i,
+                 const msec_t wake_at, struct sched_task *task)
+{
+  struct sched_timer *tm = &sched->timers[i];
+
+  tm->wake_at = wake_at;
+  tm->task = task;
+  task->timer_idx = i;
+}
+
+static void
+sched_timer_move (struct scheduler *sched, unsigned int i,
+                  const msec_t wake_at, struct sched_task *task)
+{
+  struct sched_timer *timers = sched->timers;
+  const unsigned int n = sched->ntimers;
+
+  /* sift up */
+  while (i) {
+    const unsigned int parent = (i - 1) / 2;
+
+    if (!sched_timer_before(wake_at, timers[parent].wake_at))
+      break;
+    sched_timer_set(sched, i, timers[parent].wake_at, timers[parent].task);
+    i = parent;
+  }
+  /* sift down */
+  for (; ; ) {
+    unsigned int child = i * 2 + 1;
+
+    if (child >= n) break;
+    if (child + 1 < n
+     && sched_timer_before(timers[child + 1].wake_at, timers[child].wake_at))
+      ++child;
+    if (!sched_timer_before(timers[child].wake_at, wake_at))
+      break;
+    sched_timer_set(sched, i, timers[child].wake_at, timers[child].task);
+    i = child;
+  }
+  sched_timer_set(sched, i, wake_at, task);
+}
+
+static int
+sched_timer_add (struct scheduler *sched, struct sched_task *task,
+                 const msec_t wake_at)
+{
+  if (sched->ntimers == sched->timers_max) {
+    const unsigned int newlen = sched->timers_max
+     ? sched->timers_max * 2 : SCHED_TIMERS_MIN;
+    void *p = realloc(sched->timers, newlen * sizeof(struct sched_timer));
+
+    if (!p) return -1;
+
+    sched->timers = p;
+    sched->timers_max = newlen;
+  }
+  sched_timer_move(sched, sched->ntimers++, wake_at, task);
+  task->sleeping = -1;
+  return 0;
+}
+
+static void
+sched_timer_del (struct scheduler *sched, struct sched_task *task)
+{
+  const unsigned int i = task->timer_idx;
+  const unsigned int last = --sched->ntimers;
+
+  if (i != last) {
+    struct sched_timer *tm = &sched->timers[last];
+    sched_timer_move(sched, i, tm->wake_at, tm->task);
+  }
+  task->sleeping = 0;
+}
+
+/*
+ * Wake up tasks with expired timers.
+ * Returns: milliseconds to the next timer
+ */
+static msec_t
+sched_timer_expire (struct scheduler *sched)
+{
+  const msec_t now = sys_milliseconds();
+
+  while (sched->ntimers) {
+    const struct sched_timer *tm = &sched->timers[0];
+    struct sched_task *task;
+
+    if (sched_timer_before(now, tm->wake_at))
+      return tm->wake_at - now;
+
+    task = tm->task;
+    sched_timer_del(sched, task);
+
+    task->suspended = 0;
+    sched_task_ready(sched, task, 0);
+  }
+  return TIMEOUT_INFINITE;
+}
+
+/*
+ * Accumulate the workers' lifetime.
+ */
+static void
+sched_account_workers (struct scheduler *sched, const int64_t now)
+{
+  sched->workers_time += sched->nworkers * (now - sched->workers_at);
+  sched->workers_at = now;
+}
+
+static int
+sched_worker_add (struct scheduler *sched, struct sched_context *sched_ctx)
+{
+  if (sched->steal) {
+    if (thread_cond_new(&sched_ctx->cond))
+      return -1;
+
+    sched_ctx->next_worker = sched->workers;
+    sched->workers = sched_ctx;
+  }
+  return 0;
+}
+
+static void
+sched_worker_del (struct scheduler *sched, struct sched_context *sched_ctx)
+{
+  struct sched_context **ctxp;
+  struct sched_task *task;
+
+  if (!sched->steal) return;
+
+  for (ctxp = &sched->workers; *ctxp; ctxp = &(*ctxp)->next_worker) {
+    if (*ctxp == sched_ctx) {
+      *ctxp = sched_ctx->next_worker;
+      break;
+    }
+  }
+
+  /* hand over queued tasks to other workers */
+  while ((task = sched_deque_pop(sched_ctx, 1))) {
+    task->queued = 0;
+    sched_active_add(sched, task);
+  }
+  if (sched->nactive && sched->idle_workers)
+    sched_notify(sched);
+
+  free(sched_ctx->deque);
+  sched_ctx->deque = NULL;
+
+  (void) thread_cond_del(&sched_ctx->cond);
+}
+
 static void
 sched_task_del (lua_State *L, struct scheduler *sched,
                 struct sched_task *task, const int error)
@@ -146,7 +588,7 @@ sched_task_del (lua_State *L, struct scheduler *sched,
 
   lua_assert(!task->ev_op);
 
-  sched_tasklist_add(sched, &sched->free_task_id, task);
+  sched_tasklist_add(&sched->free_tasks, task);
   sched->ntasks--;
 
   if (sched->cb_coctl) {
@@ -162,6 +604,7 @@ sched_task_del (lua_State *L, struct scheduler *sched,
   lua_pushnil(NL);
   lua_rawseti(NL, SCHED_CORO_ENV,
    sched_task_to_id(sched, task));  /* task_id -> coro */
+  task->co = NULL;
 
   if (sched->cb_coctl) {
     lua_call(L, (error ? 2 : 1), 0);
@@ -172,8 +615,12 @@ sched_task_del (lua_State *L, struct scheduler *sched,
 /*
  * Arguments: [coroutines_controller (function),
  *	min_workers (number), max_workers (number),
- *	worker_timeout (milliseconds)]
+ *	worker_timeout (milliseconds), work_stealing (boolean)]
  * Returns: [sched_udata]
+ *
+ * Note: Workers share the VM lock, so work-stealing doesn't run tasks
+ * in parallel: only one worker executes Lua code at a time, others
+ * take tasks over while it is blocked in system calls.
  */
 static int
 sched_new (lua_State *L)
@@ -181,6 +628,7 @@ sched_new (lua_State *L)
   const int min_workers = (int) lua_tointeger(L, 2);
   const int max_workers = luaL_optint(L, 3, min_workers);
   const msec_t worker_timeout = (msec_t) luaL_optinteger(L, 4, SCHED_WORKER_TIMEOUT);
+  const int steal = lua_toboolean(L, 5);
   struct scheduler *sched;
   lua_State *NL;
 
@@ -198,12 +646,10 @@ sched_new (lua_State *L)
   NL = lua_newthread(L);
   if (!NL) return 0;
 
-  sched->active_task_id
-   = sched->free_task_id = -1;
-
   sched->min_workers = min_workers;
   sched->max_workers = max_workers;
   sched->worker_timeout = worker_timeout;
+  sched->steal = steal;
 
   sched->L = NL;
   lua_rawsetp(L, -2, NL);  /* save coroutine to avoid GC */
@@ -231,12 +677,23 @@ sched_close (lua_State *L)
 {
   struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
 
+  if (sched->preempt_msec)
+    sched_preempt_set(sched, 0);
+
   (void) thread_critsect_del(&sched->cs);
   (void) thread_cond_del(&sched->cond);
 
-  if (sched->buffer) {
-    free(sched->buffer);
-    sched->buffer = NULL;
+  if (sched->chunks) {
+    int i;
+    for (i = 0; i < sched->nchunks; ++i)
+      free(sched->chunks[i]);
+    free(sched->chunks);
+    sched->chunks = NULL;
+    sched->nchunks = sched->ntotal = 0;
+  }
+  if (sched->timers) {
+    free(sched->timers);
+    sched->timers = NULL;
   }
   return 0;
 }
@@ -323,10 +780,15 @@ sched_loop (lua_State *L)
 
   if (!td) luaL_argerror(L, 0, "Threading not initialized");
 
-  sched->nworkers++;
-
+  memset(&sched_ctx, 0, sizeof(struct sched_context));
   sched_ctx.sched = sched;
-  sched_ctx.co = NULL;
+
+  if (sched_worker_add(sched, &sched_ctx))
+    return sys_seterror(L, 0);
+
+  if (sched->accounting)
+    sched_account_workers(sched, sys_microseconds());
+  sched->nworkers++;
 
   td->sched_ctx = &sched_ctx;
 
@@ -339,15 +801,23 @@ sched_loop (lua_State *L)
   for (; ; ) {
     struct sched_task *task;
     lua_State *co;
-    const int task_id = sched->active_task_id;
+    msec_t wait_timeout = TIMEOUT_INFINITE;
     int res, narg;
 
     if (sched->stop) {
-      (void) thread_cond_signal(&sched->cond);
+      sched_notify(sched);
       break;
     }
 
-    if (task_id == -1) {
+    if (sched->ntimers)
+      wait_timeout = sched_timer_expire(sched);
+
+    task = sched_task_next(sched, &sched_ctx);
+
+    if (!task) {
+      const int is_timer = (wait_timeout != TIMEOUT_INFINITE)
+       && (timeout == TIMEOUT_INFINITE || wait_timeout < timeout);
+
       if (not_linger) break;
 
       if (sched->nwaiters == (sched->nworkers - 1)
@@ -356,18 +826,40 @@ sched_loop (lua_State *L)
         lua_xmove(sched->L, L, 1);  /* evq_udata */
 
         sched->evq_waiting = 1;
-        err = sys_evq_loop(L, sched->evq, TIMEOUT_INFINITE,
+        err = sys_evq_loop(L, sched->evq, wait_timeout,
          0 /* linger */, 1 /* once */, 2 /* evq_idx */);
         sched->evq_waiting = 0;
 
+        if (err == SYS_ERR_TIMEOUT) err = 0;
+
         if (!err) lua_settop(L, 1);
         else break;
       } else {
+        if (!is_timer) wait_timeout = timeout;
+
         sched->nwaiters++;
-        res = thread_cond_wait_vm(&sched->cond, td, timeout);
+        if (sched->steal) {
+          sched_ctx.idle = 1;
+          sched_ctx.next_idle = sched->idle_workers;
+          sched->idle_workers = &sched_ctx;
+
+          res = thread_cond_wait_vm(&sched_ctx.cond, td, wait_timeout);
+
+          if (sched_ctx.idle) {
+            struct sched_context **ctxp = &sched->idle_workers;
+
+            while (*ctxp != &sched_ctx)
+              ctxp = &(*ctxp)->next_idle;
+            *ctxp = sched_ctx.next_idle;
+            sched_ctx.idle = 0;
+          }
+        } else {
+          res = thread_cond_wait_vm(&sched->cond, td, wait_timeout);
+        }
         sched->nwaiters--;
 
         sys_thread_check(td, L);
+        if (res == 1 && is_timer) continue;
         if (res) {
           err = (res == 1) ? SYS_ERR_TIMEOUT : SYS_ERR_SYSTEM;
           break;
@@ -376,9 +868,6 @@ sched_loop (lua_State *L)
       continue;
     }
 
-    task = sched_id_to_task(sched, task_id);
-    sched_tasklist_del(sched, &sched->active_task_id, task);
-
     if (task->terminate) {
       sched_task_del(L, sched, task, 0);
       continue;
@@ -393,25 +882,50 @@ sched_loop (lua_State *L)
     }
 
     thread_critsect_enter(csp);
-    sched_ctx.task_id = task_id;
+    sched_ctx.task = task;
     sched_ctx.co = co;
     sched->tick++;
     thread_critsect_leave(csp);
 
-    res = lua_resume(co, L, narg, &nresults);  /* call coroutine */
+    if (sched->accounting) {
+      const int64_t start = sys_microseconds();
+      int64_t now;
+
+      if (task->ready_at) {
+        const int64_t wait = start - task->ready_at;
+
+        sched->wait_time += wait;
+        if (sched->wait_max < wait)
+          sched->wait_max = wait;
+        sched->nwaits++;
+      }
+
+      res = lua_resume(co, L, narg, &nresults);  /* call coroutine */
+
+      now = sys_microseconds();
+      task->run_time += now - start;
+      task->ready_at = now;
+      sched->busy_time += now - start;
+    } else {
+      res = lua_resume(co, L, narg, &nresults);  /* call coroutine */
+    }
 
     thread_critsect_enter(csp);
     sched_ctx.co = NULL;
+    /* remove the preemption hook, if task yielded before it fired */
+    if (lua_gethook(co) == sched_preempt_tasks_hook)
+      lua_sethook(co, NULL, 0, 0);
     thread_critsect_leave(csp);
 
-    /* buffer may be realloc'ed */
-    task = sched_id_to_task(sched, task_id);
-
     switch (res) {
     case LUA_YIELD:
       if (!task->terminate) {
-        if (!task->suspended)
-          sched_tasklist_add(sched, &sched->active_task_id, task);
+        if (!task->suspended) {
+          if (sched->steal)
+            sched_task_ready(sched, task, 1);
+          else
+            sched_active_add(sched, task);
+        }
         break;
       }
       res = 0;
@@ -440,11 +954,14 @@ sched_loop (lua_State *L)
 
   td->sched_ctx = NULL;
 
+  sched_worker_del(sched, &sched_ctx);
+  if (sched->accounting)
+    sched_account_workers(sched, sys_microseconds());
   sched->nworkers--;
 
   if (!sched->stop && !sched->evq_waiting && sched->evq
    && sched->nwaiters == sched->nworkers)
-    (void) thread_cond_signal(&sched->cond);
+    sched_notify(sched);
 
   switch (err) {
   case SYS_ERR_TIMEOUT:
@@ -469,7 +986,7 @@ sched_stop (lua_State *L)
   const int stop = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
 
   sched->stop = stop;
-  (void) thread_cond_signal(&sched->cond);
+  sched_notify(sched);
   return 0;
 }
 
@@ -542,8 +1059,8 @@ sched_put (lua_State *L)
   task = sched_task_alloc(sched);
   if (!task) return 0;
 
-  memset(task, 0, sizeof(struct sched_task));
   task->co = co;
+  task->priority = SCHED_PRIO_NORMAL;
 
   /* store task coroutine in scheduler */
   task_id = sched_task_to_id(sched, task);
@@ -554,18 +1071,15 @@ sched_put (lua_State *L)
 
   /* add to active list */
   {
-    const int is_empty = (sched->active_task_id == -1);
+    const int is_empty = !sched_has_ready(sched);
 
-    sched_tasklist_add(sched, &sched->active_task_id, task);
     sched->ntasks++;
 
     /* notify or create new worker thread */
-    if (is_empty) {
-      if (sched->nwaiters)
-        (void) thread_cond_signal(&sched->cond);
-      else if (sched->nworkers < sched->max_workers)
-        sched_thread_run(L);
-    }
+    sched_task_ready(sched, task, 0);
+    if (is_empty && !sched->nwaiters
+     && sched->nworkers < sched->max_workers)
+      sched_thread_run(L);
   }
   lua_pushinteger(L, task_id);
   return 1;
@@ -582,7 +1096,7 @@ sched_running (lua_State *L)
   struct sched_context *sched_ctx = sched->ctx;
 
   if (sched_ctx && L == sched_ctx->co) {
-    lua_pushinteger(L, sched_ctx->task_id);
+    lua_pushinteger(L, sched_ctx->task->task_id);
     return 1;
   }
   return 0;
@@ -603,9 +1117,12 @@ sched_terminate (lua_State *L)
 
     task->terminate = -1;
 
+    if (task->sleeping)
+      sched_timer_del(sched, task);
+
     if (task->suspended) {
       task->suspended = 0;
-      sched_tasklist_add(sched, &sched->active_task_id, task);
+      sched_task_ready(sched, task, 0);
     }
 
     if (task->ev_op) {
@@ -627,8 +1144,7 @@ static int
 sched_suspend (lua_State *L)
 {
   struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
-  struct sched_task *task = !sched->ctx ? NULL
-   : sched_id_to_task(sched, sched->ctx->task_id);
+  struct sched_task *task = !sched->ctx ? NULL : sched->ctx->task;
 
   if (!task || task->ev_op || task->co != L)
     luaL_argerror(L, 2, "Running coroutine expected");
@@ -638,6 +1154,28 @@ sched_suspend (lua_State *L)
   return lua_yield(L, 0);
 }
 
+/*
+ * Arguments: sched_udata, milliseconds (number)
+ */
+static int
+sched_sleep (lua_State *L)
+{
+  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
+  const msec_t msec = (msec_t) luaL_checkinteger(L, 2);
+  struct sched_task *task = !sched->ctx ? NULL : sched->ctx->task;
+
+  if (!task || task->ev_op || task->co != L)
+    luaL_argerror(L, 1, "Running coroutine expected");
+
+  if (msec > 0) {
+    if (sched_timer_add(sched, task, sys_milliseconds() + msec))
+      return sys_seterror(L, 0);
+
+    task->suspended = -1;
+  }
+  return lua_yield(L, 0);
+}
+
 /*
  * Arguments: sched_udata, task_id, [arguments ...]
  */
@@ -655,8 +1193,11 @@ sched_resume (lua_State *L)
   if (!task || !task->suspended || task->ev_op)
     luaL_argerror(L, 2, "Suspended coroutine expected");
 
-  sched_tasklist_add(sched, &sched->active_task_id, task);
+  if (task->sleeping)
+    sched_timer_del(sched, task);
+
   task->suspended = 0;
+  sched_task_ready(sched, task, 0);
 
   if (narg) {
     lua_settop(task->co, 0);
@@ -665,6 +1206,43 @@ sched_resume (lua_State *L)
   return 0;
 }
 
+/*
+ * Arguments: sched_udata, task_id,
+ *	[priority (string: "high", "normal", "low")]
+ * Returns: sched_udata | priority (string)
+ */
+static int
+sched_priority (lua_State *L)
+{
+  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
+  const int task_id = luaL_checkint(L, 2);
+  struct sched_task *task;
+
+  task = !sched_check_task_id(sched, task_id) ? NULL
+   : sched_id_to_task(sched, task_id);
+
+  if (!task) luaL_argerror(L, 2, "Task expected");
+
+  if (lua_isnoneornil(L, 3)) {
+    lua_pushstring(L, sched_prio_names[task->priority]);
+    return 1;
+  }
+
+  {
+    const int prio = luaL_checkoption(L, 3, NULL, sched_prio_names);
+
+    if (task->active) {
+      sched_active_del(sched, task);
+      task->priority = prio;
+      sched_active_add(sched, task);
+    } else {
+      task->priority = prio;
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
 
 /*
  * Arguments: sched_udata, evq_udata, arguments ...
@@ -682,11 +1260,11 @@ sched_event_add (lua_State *L, const int type)
   lua_pushvalue(L, 2);  /* evq_udata */
   lua_insert(L, 3);
 
-  lua_pushinteger(L, sched_ctx->task_id);
+  lua_pushinteger(L, sched_ctx->task->task_id);
   lua_insert(L, 2);
 
   if (!sys_evq_sched_add(L, 4, type)) {
-    struct sched_task *task = sched_id_to_task(sched, sched_ctx->task_id);
+    struct sched_task *task = sched_ctx->task;
 
     task->suspended = -1;
 
@@ -827,11 +1405,7 @@ sys_sched_event_ready (lua_State *co, void *ev)
   task->ev_added = 0;
   task->suspended = 0;
 
-  /* notify */
-  if (sched->active_task_id == -1 && sched->nwaiters)
-    (void) thread_cond_signal(&sched->cond);
-
-  sched_tasklist_add(sched, &sched->active_task_id, task);
+  sched_task_ready(sched, task, 0);
 
   lua_remove(co, 1);  /* remove sched_udata */
   lua_remove(co, 1);  /* remove task_id */
@@ -848,40 +1422,253 @@ sched_preempt_tasks_hook (lua_State *L, lua_Debug *ar)
   lua_yield(L, 0);
 }
 
+static int
+sched_preempt_init (void)
+{
+  if (g_SchedPreempt.initialized)
+    return 0;
+
+  if (thread_critsect_new(&g_SchedPreempt.cs))
+    return -1;
+  if (thread_cond_new(&g_SchedPreempt.cond)) {
+    (void) thread_critsect_del(&g_SchedPreempt.cs);
+    return -1;
+  }
+  g_SchedPreempt.initialized = 1;
+  return 0;
+}
+
 /*
- * Arguments: sched_udata, time_slice (milliseconds)
+ * Hook the running task, if it didn't yield during time slice.
  */
-static int
-sched_preempt_tasks (lua_State *L)
+static void
+sched_preempt_check (struct scheduler *sched)
 {
-  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
-  const int msec = (int) lua_tointeger(L, 2);
   thread_critsect_t *csp = &sched->cs;
-  unsigned int old_tick = 0;
+  unsigned int tick;
 
-  sys_vm_leave(L);
-  while (!sched->stop) {
-    unsigned int tick;
+  thread_critsect_enter(csp);
+  tick = sched->tick;
+  if (tick == sched->preempt_tick && !sched->stop
+   && sched_has_ready(sched)) {
+    struct sched_context *sched_ctx = sched->ctx;
+    lua_State *co = sched_ctx ? sched_ctx->co : NULL;
+
+    if (co && !lua_gethook(co))
+      lua_sethook(co, sched_preempt_tasks_hook, LUA_MASKCOUNT,
+       SCHED_PREEMPT_COUNT);
+  }
+  thread_critsect_leave(csp);
 
-    sys_thread_sleep(msec, 1);  /* wait time slice */
+  sched->preempt_tick = tick;
+}
 
-    thread_critsect_enter(csp);
-    tick = sched->tick;
-    if (tick == old_tick && sched->active_task_id != -1) {
-      struct sched_context *sched_ctx = sched->ctx;
-      lua_State *co = sched_ctx ? sched_ctx->co : NULL;
+static THREAD_FUNC_API
+sched_preempt_thread (void *arg)
+{
+  thread_critsect_t *csp = &g_SchedPreempt.cs;
 
-      if (co && !lua_gethook(co))
-        lua_sethook(co, sched_preempt_tasks_hook, LUA_MASKCOUNT, 1);
+  (void) arg;
+
+  thread_critsect_enter(csp);
+  while (g_SchedPreempt.running) {
+    const msec_t now = sys_milliseconds();
+    msec_t timeout = TIMEOUT_INFINITE;
+    struct scheduler *sched;
+
+    for (sched = g_SchedPreempt.scheds; sched; sched = sched->preempt_next) {
+      msec_t left = sched->preempt_at - now;
+
+      if (left <= 0) {
+        sched_preempt_check(sched);
+        sched->preempt_at = now + sched->preempt_msec;
+        left = sched->preempt_msec;
+      }
+      if (timeout == TIMEOUT_INFINITE || timeout > left)
+        timeout = left;
     }
-    thread_critsect_leave(csp);
 
-    old_tick = tick;
+    (void) thread_cond_wait_nolock(&g_SchedPreempt.cond, csp, timeout);
+  }
+  thread_critsect_leave(csp);
+  return 0;
+}
+
+static int
+sched_preempt_start (void)
+{
+#ifndef _WIN32
+  pthread_t tid;
+  const int res = pthread_create(&tid, NULL,
+   (thread_func_t) sched_preempt_thread, NULL);
+
+  if (res) {
+    errno = res;
+    return -1;
   }
-  sys_vm_enter(L);
+  pthread_detach(tid);
+#else
+  unsigned int tid;
+  const uintptr_t hThr = _beginthreadex(NULL, 0,
+   (thread_func_t) sched_preempt_thread, NULL, 0, &tid);
+
+  if (!hThr) return -1;
+  CloseHandle((HANDLE) hThr);
+#endif
   return 0;
 }
 
+/*
+ * Add/remove the scheduler to/from the preemption service.
+ */
+static int
+sched_preempt_set (struct scheduler *sched, const msec_t msec)
+{
+  thread_critsect_t *csp = &g_SchedPreempt.cs;
+  int res = 0;
+
+  thread_critsect_enter(csp);
+  if (msec && !sched->preempt_msec) {
+    if (!g_SchedPreempt.running) {
+      res = sched_preempt_start();
+      g_SchedPreempt.running = !res;
+    }
+    if (!res) {
+      sched->preempt_next = g_SchedPreempt.scheds;
+      g_SchedPreempt.scheds = sched;
+    }
+  } else if (!msec && sched->preempt_msec) {
+    struct scheduler **schedp = &g_SchedPreempt.scheds;
+
+    while (*schedp != sched)
+      schedp = &(*schedp)->preempt_next;
+    *schedp = sched->preempt_next;
+  }
+  if (!res) {
+    sched->preempt_msec = msec;
+    sched->preempt_at = sys_milliseconds() + msec;
+    sched->preempt_tick = sched->tick;
+    (void) thread_cond_signal(&g_SchedPreempt.cond);
+  }
+  thread_critsect_leave(csp);
+  return res;
+}
+
+/*
+ * Arguments: sched_udata, [time_slice (milliseconds)]
+ * Returns: [sched_udata]
+ */
+static int
+sched_preempt_tasks (lua_State *L)
+{
+  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
+  const msec_t msec = (msec_t) luaL_optinteger(L, 2, 0);
+
+  if (!g_SchedPreempt.initialized)
+    luaL_argerror(L, 0, "Threading not initialized");
+  if (msec < 0) luaL_argerror(L, 2, "Non-negative time slice expected");
+
+  if (!sched_preempt_set(sched, msec)) {
+    lua_settop(L, 1);
+    return 1;
+  }
+  return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: sched_udata, [enable (boolean)]
+ * Returns: sched_udata | enabled (boolean)
+ */
+static int
+sched_accounting (lua_State *L)
+{
+  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
+
+  if (lua_isnoneornil(L, 2)) {
+    lua_pushboolean(L, sched->accounting);
+    return 1;
+  }
+
+  if (lua_toboolean(L, 2) && !sched->accounting) {
+    sched->workers_at = sys_microseconds();
+    sched->accounting = 1;
+  } else if (!lua_toboolean(L, 2)) {
+    sched->accounting = 0;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+static void
+sched_setfield (lua_State *L, const char *name, const lua_Number value)
+{
+  lua_pushnumber(L, value);
+  lua_setfield(L, -2, name);
+}
+
+/*
+ * Arguments: sched_udata, [task_id]
+ * Returns: stats (table) | run_time (microseconds)
+ */
+static int
+sched_stats (lua_State *L)
+{
+  struct scheduler *sched = checkudata(L, 1, SCHED_TYPENAME);
+  unsigned int nrunnable = 0, nsuspended = 0, nsleeping = 0, nevents = 0;
+  int i;
+
+  if (!lua_isnoneornil(L, 2)) {
+    const int task_id = luaL_checkint(L, 2);
+    struct sched_task *task = !sched_check_task_id(sched, task_id) ? NULL
+     : sched_id_to_task(sched, task_id);
+
+    if (!task || !task->co)
+      luaL_argerror(L, 2, "Task expected");
+
+    lua_pushnumber(L, (lua_Number) task->run_time);
+    return 1;
+  }
+
+  for (i = 0; i < sched->ntotal; ++i) {
+    struct sched_task *task = sched_id_to_task(sched, i);
+
+    if (!task->co) continue;
+
+    if (task->active || task->queued)
+      nrunnable++;
+    else if (task->ev_op || task->ev_added)
+      nevents++;
+    else if (task->sleeping)
+      nsleeping++;
+    else if (task->suspended)
+      nsuspended++;
+  }
+
+  lua_createtable(L, 0, 13);
+  sched_setfield(L, "tasks", sched->ntasks);
+  sched_setfield(L, "runnable", nrunnable);
+  sched_setfield(L, "running",
+   sched->ntasks - nrunnable - nevents - nsleeping - nsuspended);
+  sched_setfield(L, "suspended", nsuspended);
+  sched_setfield(L, "sleeping", nsleeping);
+  sched_setfield(L, "event_waiting", nevents);
+  sched_setfield(L, "resumes", sched->tick);
+  sched_setfield(L, "workers", sched->nworkers);
+  sched_setfield(L, "idle_workers", sched->nwaiters);
+
+  if (sched->accounting) {
+    sched_account_workers(sched, sys_microseconds());
+
+    sched_setfield(L, "busy_time", (lua_Number) sched->busy_time);
+    sched_setfield(L, "utilisation", !sched->workers_time ? 0
+     : (lua_Number) sched->busy_time / (lua_Number) sched->workers_time);
+    sched_setfield(L, "wait_avg", !sched->nwaits ? 0
+     : (lua_Number) sched->wait_time / (lua_Number) sched->nwaits);
+    sched_setfield(L, "wait_max", (lua_Number) sched->wait_max);
+  }
+  return 1;
+}
+
 /*
  * Arguments: sched_udata
  * Returns: number
@@ -924,6 +1711,8 @@ static luaL_Reg sched_meth[] = {
   {"terminate",		sched_terminate},
   {"suspend",		sched_suspend},
   {"resume",		sched_resume},
+  {"sleep",		sched_sleep},
+  {"priority",		sched_priority},
   {"wait_event",	sched_wait_event},
   {"wait_timer",	sched_wait_timer},
   {"wait_pid",		sched_wait_pid},
@@ -934,6 +1723,8 @@ static luaL_Reg sched_meth[] = {
   {"wait_signal",	sched_wait_signal},
   {"wait_socket",	sched_wait_socket},
   {"preempt_tasks",	sched_preempt_tasks},
+  {"accounting",	sched_accounting},
+  {"stats",		sched_stats},
   {"size",		sched_size},
   {"__len",		sched_size},
   {"__tostring",	sched_tostring},
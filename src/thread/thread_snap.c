@@ -0,0 +1,918 @@
+/* Lua System: Threading: Shared read-only snapshots */
+
+#define SNAP_TYPENAME	"sys.thread.snapshot"
+
+#define SNAP_MAGIC	"LSNP"
+#define SNAP_ALIGN	8
+
+/*
+ * Image layout (offsets are relative to image start):
+ *   snap_header, then tables and strings in any order.
+ * Table: snap_table, array values [1..narr],
+ *   then key/value pairs sorted by key.
+ */
+
+struct snap_header {
+  char magic[4];
+  unsigned int size;  /* size of image in bytes */
+  unsigned int root;  /* offset of root table */
+  unsigned int reserved;
+};
+
+struct snap_table {
+  unsigned int narr;  /* number of array values */
+  unsigned int nhash;  /* number of key/value pairs */
+};
+
+struct snap_value {
+  unsigned int type;  /* lua type */
+  unsigned int len;  /* length of string */
+  union {
+    lua_Number num;
+    int boolean;
+    unsigned int off;  /* offset of string or table */
+  } v;
+};
+
+/* Lookup key */
+struct snap_probe {
+  int type;
+  size_t len;
+  const char *s;
+  lua_Number num;
+};
+
+struct snap {
+  thread_atomic_t nref;
+  int is_mapped;
+  size_t size, max_size;
+  char *image;
+};
+
+struct snap_ref {
+  struct snap *snap;
+  unsigned int off;  /* offset of table */
+};
+
+/* Index of visited tables on stack while building */
+#define SNAP_VISITED_IDX	2
+
+#define snap_align(n)	(((n) + (SNAP_ALIGN - 1)) & ~(SNAP_ALIGN - 1))
+#define snap_values(tp) \
+    ((const struct snap_value *) ((const struct snap_table *) (tp) + 1))
+
+
+static void
+snap_unref (struct snap *snap)
+{
+  if (thread_atomic_add(&snap->nref, -1)) return;
+
+  if (snap->image) {
+#ifdef USE_MMAP
+    if (snap->is_mapped) {
+#ifndef _WIN32
+      munmap(snap->image, snap->size);
+#else
+      UnmapViewOfFile(snap->image);
+#endif
+    } else
+#endif
+    free(snap->image);
+  }
+  free(snap);
+}
+
+/*
+ * Returns: snapshot_udata
+ */
+static struct snap_ref *
+snap_pushref (lua_State *L, struct snap *snap, const unsigned int off)
+{
+  struct snap_ref *ref = lua_newuserdata(L, sizeof(struct snap_ref));
+
+  ref->snap = NULL;
+  luaL_getmetatable(L, SNAP_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  if (snap) {
+    thread_atomic_add(&snap->nref, 1);
+    ref->snap = snap;
+  }
+  ref->off = off;
+  return ref;
+}
+
+
+/*
+ * Allocate the aligned space in image being built.
+ * Returns: offset of space
+ */
+static unsigned int
+snap_alloc (lua_State *L, struct snap *snap, const size_t len)
+{
+  const size_t off = snap_align(snap->size);
+  const size_t size = off + len;
+
+  if (size < off || size > (unsigned int) -1)
+    luaL_error(L, "snapshot is too big");
+
+  if (size > snap->max_size) {
+    size_t max_size = snap->max_size ? snap->max_size : 4096;
+    char *p;
+
+    while (max_size < size) {
+      max_size *= 2;
+      if (max_size <= snap->max_size)
+        luaL_error(L, "snapshot is too big");
+    }
+    p = realloc(snap->image, max_size);
+    if (!p) luaL_error(L, "not enough memory");
+    snap->image = p;
+    snap->max_size = max_size;
+  }
+  memset(snap->image + snap->size, 0, size - snap->size);
+  snap->size = size;
+  return (unsigned int) off;
+}
+
+static void
+snap_probe_init (struct snap_probe *probe, const char *image,
+                 const struct snap_value *key)
+{
+  probe->type = key->type;
+  probe->len = key->len;
+  probe->s = (key->type == LUA_TSTRING) ? image + key->v.off : NULL;
+  probe->num = (key->type == LUA_TNUMBER) ? key->v.num
+   : (lua_Number) key->v.boolean;
+}
+
+/*
+ * Order keys by type, then by value (strings by length, then bytes).
+ */
+static int
+snap_keycmp (const char *image, const struct snap_value *key,
+             const struct snap_probe *probe)
+{
+  if ((int) key->type != probe->type)
+    return ((int) key->type < probe->type) ? -1 : 1;
+
+  switch (probe->type) {
+  case LUA_TSTRING:
+    if (key->len != probe->len)
+      return (key->len < probe->len) ? -1 : 1;
+    return memcmp(image + key->v.off, probe->s, probe->len);
+  case LUA_TNUMBER:
+    return (key->v.num < probe->num) ? -1 : (key->v.num > probe->num);
+  default:
+    return key->v.boolean - (int) probe->num;
+  }
+}
+
+static void
+snap_pair_swap (struct snap_value *a, struct snap_value *b)
+{
+  struct snap_value tmp[2];
+
+  memcpy(tmp, a, sizeof(tmp));
+  memcpy(a, b, sizeof(tmp));
+  memcpy(b, tmp, sizeof(tmp));
+}
+
+static void
+snap_pair_sift (const char *image, struct snap_value *pairs,
+                unsigned int i, const unsigned int n)
+{
+  for (; ; ) {
+    unsigned int child = 2 * i + 1;
+    struct snap_probe probe;
+
+    if (child >= n) break;
+    if (child + 1 < n) {
+      snap_probe_init(&probe, image, &pairs[2 * (child + 1)]);
+      if (snap_keycmp(image, &pairs[2 * child], &probe) < 0)
+        child++;
+    }
+    snap_probe_init(&probe, image, &pairs[2 * child]);
+    if (snap_keycmp(image, &pairs[2 * i], &probe) >= 0)
+      break;
+    snap_pair_swap(&pairs[2 * i], &pairs[2 * child]);
+    i = child;
+  }
+}
+
+/*
+ * Heap sort of key/value pairs by key.
+ */
+static void
+snap_pairs_sort (const char *image, struct snap_value *pairs,
+                 unsigned int n)
+{
+  unsigned int i;
+
+  for (i = n / 2; i-- > 0; )
+    snap_pair_sift(image, pairs, i, n);
+
+  while (n-- > 1) {
+    snap_pair_swap(&pairs[0], &pairs[2 * n]);
+    snap_pair_sift(image, pairs, 0, n);
+  }
+}
+
+static unsigned int snap_build_table (lua_State *L, struct snap *snap,
+                                      const int idx);
+
+/*
+ * Arguments: ..., value (boolean | number | string | table)
+ */
+static void
+snap_build_value (lua_State *L, struct snap *snap, const int idx,
+                  const unsigned int voff)
+{
+  struct snap_value v;
+
+  memset(&v, 0, sizeof(struct snap_value));
+  v.type = lua_type(L, idx);
+
+  switch (v.type) {
+  case LUA_TBOOLEAN:
+    v.v.boolean = lua_toboolean(L, idx);
+    break;
+  case LUA_TNUMBER:
+    v.v.num = lua_tonumber(L, idx);
+    break;
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(L, idx, &len);
+
+      v.v.off = snap_alloc(L, snap, len + 1);
+      v.len = (unsigned int) len;
+      memcpy(snap->image + v.v.off, s, len);
+    }
+    break;
+  case LUA_TTABLE:
+    v.v.off = snap_build_table(L, snap, idx);
+    break;
+  default:
+    luaL_error(L, "snapshot: %s value is not supported",
+     lua_typename(L, v.type));
+  }
+  memcpy(snap->image + voff, &v, sizeof(struct snap_value));
+}
+
+/*
+ * Returns: non-zero, when the key belongs to the array part
+ */
+static int
+snap_is_arrkey (lua_State *L, const int idx, const unsigned int narr)
+{
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    const lua_Number d = lua_tonumber(L, idx);
+
+    return d >= 1 && d <= narr && d == (lua_Number) (unsigned int) d;
+  }
+  return 0;
+}
+
+/*
+ * Returns: offset of table
+ */
+static unsigned int
+snap_build_table (lua_State *L, struct snap *snap, const int idx)
+{
+  struct snap_table tbl;
+  unsigned int off, voff, i;
+
+  luaL_checkstack(L, LUA_MINSTACK, "snapshot: too deep nesting");
+
+  /* already visited? */
+  lua_pushvalue(L, idx);
+  lua_rawget(L, SNAP_VISITED_IDX);
+  if (lua_isnumber(L, -1)) {
+    const lua_Number d = lua_tonumber(L, -1);
+
+    off = (unsigned int) d;
+    lua_pop(L, 1);
+    return off;
+  }
+  lua_pop(L, 1);
+
+  /* count array values */
+  for (i = 0; ; ++i) {
+    lua_rawgeti(L, idx, i + 1);
+    if (lua_isnil(L, -1)) break;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  tbl.narr = i;
+
+  /* count key/value pairs */
+  tbl.nhash = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pop(L, 1);
+    if (snap_is_arrkey(L, -1, tbl.narr)) continue;
+
+    switch (lua_type(L, -1)) {
+    case LUA_TBOOLEAN:
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+      break;
+    default:
+      luaL_error(L, "snapshot: %s key is not supported",
+       lua_typename(L, lua_type(L, -1)));
+    }
+    tbl.nhash++;
+  }
+
+  if ((size_t) tbl.narr + 2 * (size_t) tbl.nhash
+   > ((unsigned int) -1) / sizeof(struct snap_value))
+    luaL_error(L, "snapshot is too big");
+
+  off = snap_alloc(L, snap, sizeof(struct snap_table)
+   + (tbl.narr + 2 * tbl.nhash) * sizeof(struct snap_value));
+  memcpy(snap->image + off, &tbl, sizeof(struct snap_table));
+
+  lua_pushvalue(L, idx);
+  lua_pushnumber(L, off);
+  lua_rawset(L, SNAP_VISITED_IDX);
+
+  voff = off + sizeof(struct snap_table);
+  for (i = 1; i <= tbl.narr; ++i) {
+    lua_rawgeti(L, idx, i);
+    snap_build_value(L, snap, lua_gettop(L), voff);
+    lua_pop(L, 1);
+    voff += sizeof(struct snap_value);
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    const int top = lua_gettop(L);
+
+    if (!snap_is_arrkey(L, top - 1, tbl.narr)) {
+      snap_build_value(L, snap, top - 1, voff);
+      snap_build_value(L, snap, top, voff + sizeof(struct snap_value));
+      voff += 2 * sizeof(struct snap_value);
+    }
+    lua_pop(L, 1);
+  }
+
+  snap_pairs_sort(snap->image, (struct snap_value *) (snap->image + off
+   + sizeof(struct snap_table)) + tbl.narr, tbl.nhash);
+  return off;
+}
+
+
+/*
+ * Check the image header.
+ * Returns: 0 on success
+ */
+static int
+snap_check_image (const char *image, const size_t size)
+{
+  const struct snap_header *hdr = (const struct snap_header *) image;
+
+  return size < sizeof(struct snap_header)
+   || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))
+   || hdr->size != size
+   || hdr->root < sizeof(struct snap_header)
+   || hdr->root >= size;
+}
+
+/*
+ * Check the table bounds.
+ * Returns: [table]
+ */
+static const struct snap_table *
+snap_gettable (const struct snap *snap, const unsigned int off)
+{
+  const struct snap_table *tp = (const struct snap_table *)
+   (snap->image + off);
+  size_t n;
+
+  if ((off & (SNAP_ALIGN - 1)) || off >= snap->size
+   || snap->size - off < sizeof(struct snap_table))
+    return NULL;
+
+  n = (snap->size - off - sizeof(struct snap_table))
+   / sizeof(struct snap_value);
+  if (tp->narr > n || tp->nhash > (n - tp->narr) / 2)
+    return NULL;
+  return tp;
+}
+
+/*
+ * Check the value bounds.
+ * Returns: 0 on success
+ */
+static int
+snap_check_value (const struct snap *snap, const struct snap_value *vp,
+                  const int is_key)
+{
+  switch (vp->type) {
+  case LUA_TBOOLEAN:
+  case LUA_TNUMBER:
+    return 0;
+  case LUA_TSTRING:
+    return vp->v.off >= snap->size || snap->size - vp->v.off < vp->len;
+  case LUA_TTABLE:
+    return is_key || !snap_gettable(snap, vp->v.off);
+  default:
+    return -1;
+  }
+}
+
+/*
+ * Check the bounds of all tables and strings of loaded image.
+ * Returns: 0 on success
+ */
+static int
+snap_check_tables (lua_State *L, const struct snap *snap,
+                   const unsigned int root)
+{
+  const int visited_idx = lua_gettop(L) + 1;
+  const int pending_idx = visited_idx + 1;
+  int npending = 0, res = 0;
+
+  lua_newtable(L);  /* visited tables */
+  lua_newtable(L);  /* pending tables */
+
+  lua_pushnumber(L, root);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, visited_idx);
+  lua_pushnumber(L, root);
+  lua_rawseti(L, pending_idx, ++npending);
+
+  while (npending && !res) {
+    const struct snap_table *tp;
+    const struct snap_value *vp;
+    unsigned int off, i, n;
+
+    lua_rawgeti(L, pending_idx, npending);
+    {
+      const lua_Number d = lua_tonumber(L, -1);
+
+      off = (unsigned int) d;
+    }
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_rawseti(L, pending_idx, npending--);
+
+    tp = snap_gettable(snap, off);
+    if (!tp) {
+      res = -1;
+      break;
+    }
+    vp = snap_values(tp);
+    n = tp->narr + 2 * tp->nhash;
+    for (i = 0; i < n; ++i, ++vp) {
+      const int is_key = (i >= tp->narr) && !((i - tp->narr) & 1);
+
+      if (snap_check_value(snap, vp, is_key)) {
+        res = -1;
+        break;
+      }
+      if (vp->type != LUA_TTABLE) continue;
+
+      lua_pushnumber(L, vp->v.off);
+      lua_rawget(L, visited_idx);
+      if (lua_isnil(L, -1)) {
+        lua_pushnumber(L, vp->v.off);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, visited_idx);
+        lua_pushnumber(L, vp->v.off);
+        lua_rawseti(L, pending_idx, ++npending);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, visited_idx - 1);
+  return res;
+}
+
+static const struct snap_table *
+snap_checktable (lua_State *L, const struct snap_ref *ref)
+{
+  const struct snap_table *tp;
+
+  if (!ref->snap) luaL_argerror(L, 1, "closed");
+
+  tp = snap_gettable(ref->snap, ref->off);
+  if (!tp) luaL_error(L, "snapshot: corrupted image");
+  return tp;
+}
+
+/*
+ * Returns: value (any)
+ */
+static void
+snap_pushvalue (lua_State *L, const struct snap_ref *ref,
+                const struct snap_value *vp)
+{
+  const struct snap *snap = ref->snap;
+
+  switch (vp->type) {
+  case LUA_TBOOLEAN:
+    lua_pushboolean(L, vp->v.boolean);
+    break;
+  case LUA_TNUMBER:
+    lua_pushnumber(L, vp->v.num);
+    break;
+  case LUA_TSTRING:
+    if (vp->v.off >= snap->size || snap->size - vp->v.off < vp->len)
+      luaL_error(L, "snapshot: corrupted image");
+    lua_pushlstring(L, snap->image + vp->v.off, vp->len);
+    break;
+  case LUA_TTABLE:
+    if (!snap_gettable(snap, vp->v.off))
+      luaL_error(L, "snapshot: corrupted image");
+    snap_pushref(L, ref->snap, vp->v.off);
+    break;
+  default:
+    lua_pushnil(L);
+  }
+}
+
+/*
+ * Returns: [value]
+ */
+static const struct snap_value *
+snap_lookup (lua_State *L, const struct snap_ref *ref,
+             const struct snap_table *tp, const int idx)
+{
+  const char *image = ref->snap->image;
+  const struct snap_value *pairs = snap_values(tp) + tp->narr;
+  struct snap_probe probe;
+  unsigned int lo = 0, hi = tp->nhash;
+
+  probe.type = lua_type(L, idx);
+  probe.len = 0;
+  probe.s = NULL;
+  probe.num = 0;
+
+  switch (probe.type) {
+  case LUA_TNUMBER:
+    probe.num = lua_tonumber(L, idx);
+    if (probe.num != probe.num)
+      return NULL;  /* NaN: not a key, compares equal to any number */
+    if (probe.num >= 1 && probe.num <= tp->narr
+     && probe.num == (lua_Number) (unsigned int) probe.num)
+      return snap_values(tp) + ((unsigned int) probe.num - 1);
+    break;
+  case LUA_TSTRING:
+    probe.s = lua_tolstring(L, idx, &probe.len);
+    break;
+  case LUA_TBOOLEAN:
+    {
+      const int boolean = lua_toboolean(L, idx);
+
+      probe.num = (lua_Number) boolean;
+    }
+    break;
+  default:
+    return NULL;
+  }
+
+  while (lo < hi) {
+    const unsigned int mid = lo + (hi - lo) / 2;
+    const int res = snap_keycmp(image, &pairs[2 * mid], &probe);
+
+    if (!res) return &pairs[2 * mid + 1];
+    if (res < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+
+/*
+ * Arguments: table | image (string)
+ * Returns: [snapshot_udata]
+ *
+ * Note: Pass snapshots to other VM-threads as thread.runvm() or
+ * vm_pool:run() arguments; pipes, channels and data pools carry userdata
+ * as bare pointers, without holding a reference.
+ */
+static int
+snap_new (lua_State *L)
+{
+  struct snap_ref *ref;
+  struct snap *snap;
+
+  if (lua_type(L, 1) != LUA_TSTRING)
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+  lua_settop(L, 1);
+  lua_newtable(L);  /* visited tables */
+
+  ref = snap_pushref(L, NULL, 0);
+  snap = calloc(1, sizeof(struct snap));
+  if (!snap) return sys_seterror(L, 0);
+  snap->nref = 1;
+  ref->snap = snap;
+
+  if (lua_istable(L, 1)) {
+    struct snap_header hdr;
+
+    snap_alloc(L, snap, sizeof(struct snap_header));
+    hdr.root = snap_build_table(L, snap, 1);
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.size = (unsigned int) snap->size;
+    hdr.reserved = 0;
+    memcpy(snap->image, &hdr, sizeof(struct snap_header));
+
+    /* shrink the image */
+    {
+      char *p = realloc(snap->image, snap->size);
+      if (p) snap->image = p;
+    }
+  } else {
+    size_t len;
+    const char *s = lua_tolstring(L, 1, &len);
+
+    if (snap_check_image(s, len))
+      luaL_argerror(L, 1, "invalid snapshot image");
+
+    snap->image = malloc(len);
+    if (!snap->image) return sys_seterror(L, 0);
+    memcpy(snap->image, s, len);
+    snap->size = len;
+
+    if (snap_check_tables(L, snap,
+     ((const struct snap_header *) s)->root))
+      luaL_argerror(L, 1, "invalid snapshot image");
+  }
+  ref->off = ((struct snap_header *) snap->image)->root;
+  snap_checktable(L, ref);
+  return 1;
+}
+
+#ifdef USE_MMAP
+
+/*
+ * Arguments: filename (string)
+ * Returns: [snapshot_udata]
+ */
+static int
+snap_map (lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct snap_ref *ref;
+  struct snap *snap;
+  void *ptr = NULL;
+  size_t len = 0;
+
+  ref = snap_pushref(L, NULL, 0);
+  snap = calloc(1, sizeof(struct snap));
+  if (!snap) return sys_seterror(L, 0);
+  snap->nref = 1;
+  ref->snap = snap;
+
+#ifndef _WIN32
+  {
+    struct stat sb;
+    int fd;
+
+    sys_vm_leave(L);
+    fd = open(path, O_RDONLY);
+    if (fd != -1) {
+      if (!fstat(fd, &sb) && sb.st_size > 0
+       && (uint64_t) sb.st_size < (unsigned int) -1) {
+        len = (size_t) sb.st_size;
+        ptr = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) ptr = NULL;
+      }
+      close(fd);
+    }
+    sys_vm_enter(L);
+  }
+#else
+  {
+    const DWORD share = FILE_SHARE_READ;
+    const DWORD attr = FILE_ATTRIBUTE_NORMAL;
+    HANDLE fd;
+
+    void *os_path = utf8_to_filename(path);
+    if (!os_path)
+      return sys_seterror(L, ERROR_NOT_ENOUGH_MEMORY);
+
+    sys_vm_leave(L);
+    fd = is_WinNT
+     ? CreateFileW(os_path, GENERIC_READ, share, NULL, OPEN_EXISTING, attr, NULL)
+     : CreateFileA(os_path, GENERIC_READ, share, NULL, OPEN_EXISTING, attr, NULL);
+
+    free(os_path);
+    if (fd != INVALID_HANDLE_VALUE) {
+      DWORD size_hi;
+      const DWORD size_lo = GetFileSize(fd, &size_hi);
+
+      if (size_lo != (DWORD) -1L && !size_hi && size_lo) {
+        HANDLE hmap = CreateFileMapping(fd, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (hmap) {
+          len = size_lo;
+          ptr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, len);
+          CloseHandle(hmap);
+        }
+      }
+      CloseHandle(fd);
+    }
+    sys_vm_enter(L);
+  }
+#endif
+
+  if (!ptr) return sys_seterror(L, 0);
+
+  snap->image = ptr;
+  snap->size = len;
+  snap->is_mapped = 1;
+
+  if (snap_check_image(snap->image, snap->size)
+   || snap_check_tables(L, snap, ((struct snap_header *) snap->image)->root))
+    luaL_argerror(L, 1, "invalid snapshot image");
+
+  ref->off = ((struct snap_header *) snap->image)->root;
+  snap_checktable(L, ref);
+  return 1;
+}
+
+#endif /* USE_MMAP */
+
+/*
+ * Arguments: snapshot_udata
+ */
+static int
+snap_close (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+
+  if (ref->snap) {
+    snap_unref(ref->snap);
+    ref->snap = NULL;
+  }
+  return 0;
+}
+
+/*
+ * Arguments: snapshot_udata, dest. thread (ludata)
+ */
+static int
+snap_xdup (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+  lua_State *L2 = (lua_State *) lua_touserdata(L, 2);
+
+  if (!L2) luaL_argerror(L, 2, "VM-thread expected");
+  if (!ref->snap) luaL_argerror(L, 1, "closed");
+
+  snap_pushref(L2, ref->snap, ref->off);
+  return 0;
+}
+
+/*
+ * Arguments: snapshot_udata, key (any)
+ * Returns: value (any)
+ */
+static int
+snap_index (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+
+  if (ref->snap) {
+    const struct snap_table *tp = snap_checktable(L, ref);
+    const struct snap_value *vp = snap_lookup(L, ref, tp, 2);
+
+    if (vp) {
+      snap_pushvalue(L, ref, vp);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Arguments: snapshot_udata
+ * Returns: number
+ */
+static int
+snap_len (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+  const struct snap_table *tp = snap_checktable(L, ref);
+
+  lua_pushinteger(L, tp->narr);
+  return 1;
+}
+
+/*
+ * Arguments: snapshot_udata
+ * Returns: [key (any), value (any)]
+ */
+static int
+snap_next (lua_State *L)
+{
+  struct snap_ref *ref = lua_touserdata(L, lua_upvalueindex(1));
+  const struct snap_table *tp = snap_checktable(L, ref);
+  const unsigned int i = (unsigned int) lua_tointeger(L, lua_upvalueindex(2));
+  const struct snap_value *vp = snap_values(tp);
+
+  if (i >= tp->narr + tp->nhash) return 0;
+
+  lua_pushinteger(L, i + 1);
+  lua_replace(L, lua_upvalueindex(2));
+
+  if (i < tp->narr) {
+    lua_pushinteger(L, i + 1);
+    vp += i;
+  } else {
+    vp += tp->narr + 2 * (i - tp->narr);
+    snap_pushvalue(L, ref, vp++);
+  }
+  snap_pushvalue(L, ref, vp);
+  return 2;
+}
+
+/*
+ * Arguments: snapshot_udata
+ * Returns: iterator (function)
+ */
+static int
+snap_pairs (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+
+  snap_checktable(L, ref);
+  lua_settop(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, snap_next, 2);
+  return 1;
+}
+
+/*
+ * Arguments: snapshot_udata
+ * Returns: image (string)
+ */
+static int
+snap_dump (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+  const struct snap *snap;
+  struct snap_header hdr;
+  luaL_Buffer b;
+
+  snap_checktable(L, ref);
+  snap = ref->snap;
+
+  /* current table is the root of image */
+  memcpy(&hdr, snap->image, sizeof(struct snap_header));
+  hdr.root = ref->off;
+
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, (const char *) &hdr, sizeof(struct snap_header));
+  luaL_addlstring(&b, snap->image + sizeof(struct snap_header),
+   snap->size - sizeof(struct snap_header));
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/*
+ * Arguments: snapshot_udata
+ * Returns: string
+ */
+static int
+snap_tostring (lua_State *L)
+{
+  struct snap_ref *ref = checkudata(L, 1, SNAP_TYPENAME);
+
+  lua_pushfstring(L, SNAP_TYPENAME " (%p)", ref->snap);
+  return 1;
+}
+
+
+#ifdef USE_MMAP
+#define SNAP_MAP_METHODS \
+  {"snapshot_map",	snap_map},
+#else
+#define SNAP_MAP_METHODS
+#endif
+
+/* Snapshot fields are the table's data, so methods are library functions */
+#define SNAP_METHODS \
+  SNAP_MAP_METHODS \
+  {"snapshot",		snap_new}, \
+  {"snapshot_pairs",	snap_pairs}, \
+  {"snapshot_dump",	snap_dump}, \
+  {"snapshot_close",	snap_close}
+
+static luaL_Reg snap_meth[] = {
+  {THREAD_XDUP_TAG,	snap_xdup},
+  {"__index",		snap_index},
+  {"__len",		snap_len},
+  {"__pairs",		snap_pairs},
+  {"__tostring",	snap_tostring},
+  {"__gc",		snap_close},
+  {NULL, NULL}
+};
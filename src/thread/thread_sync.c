@@ -54,6 +54,37 @@ thread_critsect_new (thread_critsect_t *tcs)
 #define thread_critsect_leave(tcs)	LeaveCriticalSection(tcs)
 #endif
 
+/* Returns zero, when the lock acquired */
+#if !defined(_WIN32)
+#define thread_critsect_trylock(tcs)	pthread_mutex_trylock(tcs)
+#elif defined(USE_PTHREAD_SYNC)
+#define thread_critsect_trylock(tcs)	!TryAcquireSRWLockExclusive(tcs)
+#else
+#define thread_critsect_trylock(tcs)	!TryEnterCriticalSection(tcs)
+#endif
+
+
+/* Atomic Operations */
+#if defined(_WIN32)
+typedef LONG volatile		thread_atomic_t;
+
+#define thread_atomic_add(p,v)		(InterlockedExchangeAdd((p), (v)) + (v))
+#define thread_atomic_xchg(p,v)		InterlockedExchange((p), (v))
+#define thread_atomic_cas(p,old,new)     (InterlockedCompareExchange((p), (new), (old)) == (old))
+#define thread_cpu_relax()		YieldProcessor()
+#else
+typedef int volatile		thread_atomic_t;
+
+#define thread_atomic_add(p,v)		__sync_add_and_fetch((p), (v))
+#define thread_atomic_xchg(p,v)		__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define thread_atomic_cas(p,old,new)     __sync_bool_compare_and_swap((p), (old), (new))
+#if defined(__i386__) || defined(__x86_64__)
+#define thread_cpu_relax()		__asm__ __volatile__ ("pause")
+#else
+#define thread_cpu_relax()		__sync_synchronize()
+#endif
+#endif
+
 
 /* Condition */
 #if !defined(_WIN32)
@@ -150,6 +181,8 @@ thread_cond_wait_nolock (thread_cond_t *condp, thread_critsect_t *csp,
   return 0;
 }
 
+#if !defined(__linux__)
+
 static int
 thread_cond_wait_value (thread_cond_t *condp, thread_critsect_t *csp,
                         volatile unsigned int *signalled,
@@ -192,6 +225,8 @@ thread_cond_wait_value (thread_cond_t *condp, thread_critsect_t *csp,
   return 0;
 }
 
+#endif  /* !defined(__linux__) */
+
 #else  /* Win32 */
 
 static int
@@ -247,6 +282,89 @@ thread_handle_wait (HANDLE h, const msec_t timeout)
 
 
 /* Event */
+#if defined(__linux__)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define USE_FUTEX_EVENT
+
+typedef struct {
+  thread_atomic_t signalled;
+  thread_atomic_t nwaiters;
+} thread_event_t;
+
+
+#define thread_futex(addr,op,val,ts) \
+    syscall(SYS_futex, (addr), (op), (val), (ts), NULL, 0)
+
+static int
+thread_event_new (thread_event_t *tev)
+{
+  tev->signalled = 0;
+  tev->nwaiters = 0;
+  return 0;
+}
+
+static int
+thread_event_del (thread_event_t *tev)
+{
+  (void) tev;
+
+  return 0;
+}
+
+static int
+thread_event_wait (thread_event_t *tev, struct sys_thread *td,
+                   const msec_t timeout)
+{
+  const msec_t deadline = (timeout == TIMEOUT_INFINITE)
+   ? 0 : sys_milliseconds() + timeout;
+  int res = 0;
+
+  sys_vm2_leave(td);
+  thread_atomic_add(&tev->nwaiters, 1);
+
+  while (!thread_atomic_cas(&tev->signalled, 1, 0)) {
+    struct timespec ts, *tsp = NULL;
+
+    if (timeout != TIMEOUT_INFINITE) {
+      const msec_t left = deadline - sys_milliseconds();
+
+      if (left <= 0) {
+        res = 1;  /* timed out */
+        break;
+      }
+      ts.tv_sec = left / 1000;
+      ts.tv_nsec = (left % 1000) * 1000000;
+      tsp = &ts;
+    }
+
+    if (thread_futex(&tev->signalled, FUTEX_WAIT_PRIVATE, 0, tsp) == -1
+     && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      res = -1;
+      break;
+    }
+  }
+
+  thread_atomic_add(&tev->nwaiters, -1);
+  sys_vm2_enter(td);
+  return res;
+}
+
+static int
+thread_event_signal (thread_event_t *tev)
+{
+  if (!thread_atomic_xchg(&tev->signalled, 1) && tev->nwaiters)
+    return (thread_futex(&tev->signalled, FUTEX_WAKE_PRIVATE, 1, NULL)
+     == -1) ? -1 : 0;
+  return 0;
+}
+
+#define thread_event_signal_nolock(tev)		thread_event_signal(tev)
+
+#else
+
 typedef struct {
   thread_cond_t cond;
 #if defined(USE_PTHREAD_SYNC)
@@ -325,3 +443,4 @@ thread_event_signal (thread_event_t *tev)
 #endif
 }
 
+#endif  /* !defined(__linux__) */
@@ -0,0 +1,471 @@
+/* Lua System: Threading: VM Pool */
+
+#define VMPOOL_TYPENAME	"sys.thread.vm_pool"
+
+struct vmpool;
+
+struct vmpool_slot {
+  struct vmpool *pool;
+  struct sys_thread *td;  /* VM-thread */
+  struct vmpool_slot *next_idle;
+
+  thread_id_t tid;  /* to join the VM-thread */
+
+  unsigned int idle:	1;  /* in idle list */
+  unsigned int pending:	1;  /* job is posted */
+  unsigned int started:	1;  /* VM-thread is created */
+
+  thread_cond_t cond;  /* notification */
+};
+
+struct vmpool {
+  thread_critsect_t cs;  /* guard pool's state */
+  thread_cond_t cond;  /* VM became idle */
+
+  struct vmpool_slot *idle;  /* idle VMs list */
+
+  int nref;  /* number of running VMs + pool_udata */
+  int size;  /* number of slots */
+  int closing;
+
+  struct vmpool_slot slots[1];
+};
+
+
+static void
+vmpool_free (struct vmpool *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->size; ++i)
+    (void) thread_cond_del(&pool->slots[i].cond);
+
+  (void) thread_cond_del(&pool->cond);
+  (void) thread_critsect_del(&pool->cs);
+  free(pool);
+}
+
+/*
+ * Release the reference to pool.
+ */
+static void
+vmpool_unref (struct vmpool *pool)
+{
+  int nref;
+
+  thread_critsect_enter(&pool->cs);
+  nref = --pool->nref;
+  thread_critsect_leave(&pool->cs);
+
+  if (!nref) vmpool_free(pool);
+}
+
+/*
+ * Put the slot to idle list (guarded by pool->cs).
+ */
+static void
+vmpool_idle_push (struct vmpool *pool, struct vmpool_slot *slot)
+{
+  slot->next_idle = pool->idle;
+  pool->idle = slot;
+  slot->idle = 1;
+
+  (void) thread_cond_signal(&pool->cond);
+  if (pool->closing)
+    (void) thread_cond_signal(&slot->cond);
+}
+
+/*
+ * Remove the slot from idle list (guarded by pool->cs).
+ */
+static void
+vmpool_idle_del (struct vmpool *pool, struct vmpool_slot *slot)
+{
+  struct vmpool_slot **slotp = &pool->idle;
+
+  while (*slotp != slot)
+    slotp = &(*slotp)->next_idle;
+  *slotp = slot->next_idle;
+  slot->idle = 0;
+}
+
+/*
+ * Notify the waiters about pool closing (guarded by pool->cs).
+ */
+static void
+vmpool_shutdown (struct vmpool *pool)
+{
+  int i;
+
+  pool->closing = 1;
+
+  (void) thread_cond_signal(&pool->cond);
+  for (i = 0; i < pool->size; ++i)
+    (void) thread_cond_signal(&pool->slots[i].cond);
+}
+
+/*
+ * Arguments: function, [arguments (any) ...]
+ */
+static void
+vmpool_call (lua_State *L, const int narg)
+{
+  if (lua_pcall(L, narg, 0, 0)) {
+    const char *msg = (lua_type(L, -1) == LUA_TSTRING)
+     ? lua_tostring(L, -1) : NULL;
+
+    if (!msg) msg = "(error object is not a string)";
+    lua_writestringerror("%s\n", msg);
+    lua_pop(L, 1);
+  }
+}
+
+/*
+ * Main function of pooled VM-thread.
+ * Arguments: [init_function]
+ */
+static int
+vmpool_worker (lua_State *L)
+{
+  struct vmpool_slot *slot = lua_touserdata(L, lua_upvalueindex(1));
+  struct vmpool *pool = slot->pool;
+  struct sys_thread *td = sys_thread_get();
+  thread_critsect_t *csp = &pool->cs;
+
+  if (lua_isfunction(L, 1))
+    vmpool_call(L, lua_gettop(L) - 1);
+  lua_settop(L, 0);
+
+  for (; ; ) {
+    int closing;
+
+    sys_vm2_leave(td);
+    thread_critsect_enter(csp);
+    vmpool_idle_push(pool, slot);
+
+    /* the job is posted to the stack of VM-thread */
+    while (!slot->pending && !(pool->closing && slot->idle))
+      (void) thread_cond_wait_nolock(&slot->cond, csp, TIMEOUT_INFINITE);
+
+    closing = !slot->pending;
+    if (closing)
+      vmpool_idle_del(pool, slot);
+    slot->pending = 0;
+    thread_critsect_leave(csp);
+    sys_vm2_enter(td);
+
+    if (closing) break;
+
+    vmpool_call(L, lua_gettop(L) - 1);
+    lua_settop(L, 0);
+  }
+
+  vmpool_unref(pool);
+  return 0;
+}
+
+/*
+ * Arguments: options (table: {size = number, libs = {1..n: string},
+ *	init = filename (string) | function_dump (string), cpu = number,
+ *	cpus = {1..n: number}, node = number, stack_size = number,
+ *	guard = number})
+ * Returns: [vmpool_udata]
+ */
+static int
+vmpool_new (lua_State *L)
+{
+  struct sys_thread *vmtd = sys_thread_get();
+  struct vmpool *pool, **poolp;
+  affin_mask_t *cpus;
+  unsigned int loadlibs = ~0U;  /* load all standard libraries */
+  int size, is_affin = 0, cpu = 0;
+  int i, res = 0;
+  size_t stack_size, guard_size;
+  unsigned int stack_paint;
+
+  if (!vmtd) luaL_argerror(L, 0, "Threading not initialized");
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  lua_getfield(L, 1, "size");
+  size = (int) lua_tointeger(L, -1);
+  if (size <= 0) luaL_argerror(L, 1, "positive size expected");
+
+  lua_getfield(L, 1, "libs");
+  if (lua_istable(L, -1))
+    loadlibs = thread_loadlibs(L, -1);
+
+  lua_getfield(L, 1, "init");
+  if (!lua_isnil(L, -1))
+    luaL_checkstring(L, -1);
+
+  lua_getfield(L, 1, "cpu");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    cpu = (int) lua_tointeger(L, -1);
+    is_affin = 1;
+  }
+  lua_pop(L, 1);
+
+  stack_size = vmtd->vmtd->stack_size;
+  guard_size = vmtd->vmtd->guard_size;
+  thread_stack_opt(L, 1, &stack_size, &guard_size, &stack_paint);
+
+  poolp = lua_newuserdata(L, sizeof(void *));
+  *poolp = NULL;
+  luaL_getmetatable(L, VMPOOL_TYPENAME);
+  lua_setmetatable(L, -2);
+
+  pool = calloc(1, sizeof(struct vmpool)
+   + (size - 1) * sizeof(struct vmpool_slot));
+  if (!pool) goto err;
+
+  if (thread_critsect_new(&pool->cs)) {
+    free(pool);
+    goto err;
+  }
+  if (thread_cond_new(&pool->cond)) {
+    (void) thread_critsect_del(&pool->cs);
+    free(pool);
+    goto err;
+  }
+  for (i = 0; i < size; ++i) {
+    if (thread_cond_new(&pool->slots[i].cond)) {
+      pool->size = i;
+      vmpool_free(pool);
+      goto err;
+    }
+    pool->slots[i].pool = pool;
+  }
+  pool->size = size;
+  pool->nref = 1;
+  *poolp = pool;
+
+  cpus = affin_mask_opt(L, 1);
+  if (cpus) is_affin = 1;
+
+  /* start VM-threads */
+  for (i = 0; i < size; ++i) {
+    struct vmpool_slot *slot = &pool->slots[i];
+    struct sys_thread *td = thread_newvm(NULL, NULL, loadlibs);
+    lua_State *NL;
+
+    if (!td) {
+      res = -1;
+      break;
+    }
+    td->vmtd->stack_size = stack_size;
+    td->vmtd->guard_size = guard_size;
+    td->vmtd->cpu = is_affin ? cpu : vmtd->vmtd->cpu;
+    td->vmtd->cpus = affin_mask_dup(cpus ? cpus : vmtd->vmtd->cpus);
+    slot->td = td;
+
+    NL = td->L;
+    lua_pushlightuserdata(NL, slot);
+    lua_pushcclosure(NL, vmpool_worker, 1);
+
+    if (lua_isstring(L, -2) && thread_loadchunk(L, NL, -2)) {
+      lua_close(NL);
+      res = 1;  /* error message */
+      break;
+    }
+
+    thread_critsect_enter(&pool->cs);
+    pool->nref++;
+    thread_critsect_leave(&pool->cs);
+
+    if (sys_thread_create(td, is_affin)) {
+      vmpool_unref(pool);
+      lua_close(NL);
+      res = -1;
+      break;
+    }
+    slot->tid = td->tid;
+    slot->started = 1;
+  }
+  if (cpus) affin_mask_del(cpus);
+
+  if (res) {
+    /* stop started VM-threads */
+    thread_critsect_enter(&pool->cs);
+    vmpool_shutdown(pool);
+    thread_critsect_leave(&pool->cs);
+
+    if (res == 1) lua_error(L);
+    goto err;
+  }
+  return 1;
+ err:
+  return sys_seterror(L, 0);
+}
+
+/*
+ * Arguments: vmpool_udata
+ *
+ * Waits for VM-threads to finish their running jobs.
+ */
+static int
+vmpool_close (lua_State *L)
+{
+  struct vmpool **poolp = checkudata(L, 1, VMPOOL_TYPENAME);
+  struct vmpool *pool = *poolp;
+
+  if (pool) {
+    int i;
+
+    *poolp = NULL;
+
+    thread_critsect_enter(&pool->cs);
+    vmpool_shutdown(pool);
+    thread_critsect_leave(&pool->cs);
+
+    sys_vm_leave(L);
+    for (i = 0; i < pool->size; ++i) {
+      struct vmpool_slot *slot = &pool->slots[i];
+
+      if (!slot->started) continue;
+#ifndef _WIN32
+      pthread_join(slot->tid, NULL);
+#else
+      WaitForSingleObject(slot->tid, INFINITE);
+      CloseHandle(slot->tid);
+#endif
+    }
+    sys_vm_enter(L);
+
+    vmpool_unref(pool);
+  }
+  return 0;
+}
+
+/*
+ * Post the job to the stack of locked VM-thread.
+ * Arguments: VM-thread (ludata), filename (string) | function_dump (string),
+ *	[arguments (string | number | boolean | ludata | share_object) ...]
+ */
+static int
+vmpool_post (lua_State *L)
+{
+  lua_State *NL = lua_touserdata(L, 1);
+
+  if (thread_loadchunk(L, NL, 2))
+    lua_error(L);
+  thread_copy_args(L, NL, 3);
+  return 0;
+}
+
+/*
+ * Arguments: vmpool_udata,
+ *	filename (string) | function_dump (string),
+ *	[arguments (string | number | boolean | ludata | share_object) ...]
+ * Returns: [boolean]
+ */
+static int
+vmpool_run (lua_State *L)
+{
+  struct vmpool **poolp = checkudata(L, 1, VMPOOL_TYPENAME);
+  struct vmpool *pool = *poolp;
+  struct sys_thread *td = sys_thread_get();
+  struct vmpool_slot *slot = NULL;
+  struct sys_thread *vmtd;
+  lua_State *NL;
+  int top, res;
+
+  if (!td) luaL_argerror(L, 0, "Threading not initialized");
+  if (!pool) luaL_argerror(L, 1, "closed");
+  luaL_checkstring(L, 2);
+
+  /* wait for idle VM-thread */
+  sys_vm2_leave(td);
+  thread_critsect_enter(&pool->cs);
+  while (!pool->idle && !pool->closing)
+    (void) thread_cond_wait_nolock(&pool->cond, &pool->cs, TIMEOUT_INFINITE);
+  if (pool->closing) {
+    (void) thread_cond_signal(&pool->cond);  /* wake up other waiters */
+  } else {
+    slot = pool->idle;
+    vmpool_idle_del(pool, slot);
+  }
+  thread_critsect_leave(&pool->cs);
+  sys_vm2_enter(td);
+
+  if (!slot) luaL_argerror(L, 1, "closed");
+
+  /* post the job */
+  vmtd = slot->td;
+  NL = vmtd->L;
+  lua_pushcfunction(L, vmpool_post);
+  lua_insert(L, 2);
+  lua_pushlightuserdata(L, NL);
+  lua_insert(L, 3);
+
+  thread_vm_lock(vmtd->vmtd);
+  top = lua_gettop(NL);
+  res = lua_pcall(L, lua_gettop(L) - 2, 0, 0);
+  if (res) lua_settop(NL, top);
+  thread_critsect_leave(vmtd->vmcsp);
+
+  if (res) {
+    thread_critsect_enter(&pool->cs);
+    vmpool_idle_push(pool, slot);
+    thread_critsect_leave(&pool->cs);
+
+    lua_error(L);
+  }
+
+  thread_critsect_enter(&pool->cs);
+  slot->pending = 1;
+  (void) thread_cond_signal(&slot->cond);
+  thread_critsect_leave(&pool->cs);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+ * Arguments: vmpool_udata
+ * Returns: size (number), idle (number)
+ */
+static int
+vmpool_size (lua_State *L)
+{
+  struct vmpool **poolp = checkudata(L, 1, VMPOOL_TYPENAME);
+  struct vmpool *pool = *poolp;
+  struct vmpool_slot *slot;
+  int nidle = 0;
+
+  if (!pool) return 0;
+
+  thread_critsect_enter(&pool->cs);
+  for (slot = pool->idle; slot; slot = slot->next_idle)
+    nidle++;
+  thread_critsect_leave(&pool->cs);
+
+  lua_pushinteger(L, pool->size);
+  lua_pushinteger(L, nidle);
+  return 2;
+}
+
+/*
+ * Arguments: vmpool_udata
+ * Returns: string
+ */
+static int
+vmpool_tostring (lua_State *L)
+{
+  struct vmpool **poolp = checkudata(L, 1, VMPOOL_TYPENAME);
+
+  lua_pushfstring(L, VMPOOL_TYPENAME " (%p)", *poolp);
+  return 1;
+}
+
+
+#define VMPOOL_METHODS \
+  {"vm_pool",		vmpool_new}
+
+static luaL_Reg vmpool_meth[] = {
+  {"run",		vmpool_run},
+  {"size",		vmpool_size},
+  {"close",		vmpool_close},
+  {"__tostring",	vmpool_tostring},
+  {"__gc",		vmpool_close},
+  {NULL, NULL}
+};
@@ -117,3 +117,22 @@ do
 end
 
 
+
+
+print"-- Vectored write"
+do
+  local fdi, fdo = sys.handle(), sys.handle()
+  assert(fdi:pipe(fdo))
+
+  local buf = assert(mem.pointer():alloc())
+  buf:write("body")
+
+  local done, n = fdo:write("head\n", buf, "", "\ntail")
+  assert(done == true and n == 14)
+  assert(buf:seek() == 0)
+
+  assert(fdi:read(14) == "head\nbody\ntail")
+  fdi:close()
+  fdo:close()
+  print"OK"
+end
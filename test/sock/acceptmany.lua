@@ -0,0 +1,48 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1313
+local host = "127.0.0.1"
+local nclients = 5
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local listener = sock.handle()
+assert(listener:socket())
+assert(listener:sockopt("reuseaddr", 1))
+assert(listener:bind(saddr))
+assert(listener:listen())
+assert(listener:nonblocking(true))
+
+local clients = {}
+for i = 1, nclients do
+	local fd = sock.handle()
+	assert(fd:socket())
+	assert(fd:connect(saddr))
+	clients[i] = fd
+end
+
+-- Accept pending connections at once
+local sockets, peers = assert(listener:accept_many(nil, {peers = true}))
+assert(#sockets == nclients and #peers == nclients)
+
+for i, fd in ipairs(sockets) do
+	assert(fd:read() == false)  -- non-blocking
+	assert(sock.inet_ntop(select(2, peers[i]:inet())) == host)
+end
+
+assert(listener:accept_many() == false)
+
+-- Blocking listener returns, when pending connections are accepted
+assert(listener:nonblocking(false))
+local fd = sock.handle()
+assert(fd:socket())
+assert(fd:connect(saddr))
+sockets = assert(listener:accept_many(4))
+assert(#sockets == 1)
+
+print"OK"
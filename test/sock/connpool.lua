@@ -0,0 +1,55 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1314
+local host = "127.0.0.1"
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local listener = sock.handle()
+assert(listener:socket())
+assert(listener:sockopt("reuseaddr", 1))
+assert(listener:bind(saddr))
+assert(listener:listen())
+
+local pool = assert(sock.conn_pool(2))
+
+-- New connection
+local fd = assert(pool:get(saddr))
+local peer = sock.handle()
+assert(listener:accept(peer))
+assert(pool:count(saddr) == 1)
+
+-- Reuse idle connection
+pool:put(fd)
+assert(select(2, pool:count(saddr)) == 1)
+assert(pool:get(saddr) == fd)
+
+-- Limit of connections per destination
+local fd2 = assert(pool:get(saddr))
+local peer2 = sock.handle()
+assert(listener:accept(peer2))
+assert(pool:get(saddr) == false)
+
+-- Closed by peer: dropped by prune
+pool:put(fd2)
+peer2:close()
+sys.thread.sleep(100)
+assert(pool:prune() == 1)
+assert(pool:count() == 1)
+
+-- Closed by peer: dropped by event queue watch
+local evq = assert(sys.event_queue())
+pool:watch(evq)
+pool:put(fd)
+peer:close()
+assert(evq:loop(1000))
+assert(pool:count() == 0)
+
+pool:close()
+
+print"OK"
@@ -0,0 +1,44 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1313
+local host = "127.0.0.1"
+
+-- Key material negotiated by the TLS handshake (test values)
+local key = ("\1"):rep(16)
+local iv = ("\2"):rep(8)
+local salt = ("\3"):rep(4)
+local rec_seq = ("\0"):rep(8)
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local listener = sock.handle()
+assert(listener:socket())
+assert(listener:sockopt("reuseaddr", 1))
+assert(listener:bind(saddr))
+assert(listener:listen())
+
+local client = sock.handle()
+assert(client:socket())
+assert(client:connect(saddr))
+
+local server = sock.handle()
+assert(listener:accept(server))
+
+local _, err = client:ktls("tx", "1.3", "aes_gcm_128", key, iv, salt, rec_seq)
+if err then
+	print("kTLS not supported:", err)
+	return
+end
+assert(server:ktls("rx", "1.3", "aes_gcm_128", key, iv, salt, rec_seq))
+
+-- Records are encrypted/decrypted by the kernel
+local msg = "kernel TLS record"
+assert(client:write(msg))
+assert(server:read(#msg) == msg)
+
+print"OK"
@@ -0,0 +1,50 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+-- client <-> (proxy_in => proxy_out) <-> server
+local client, proxy_in = sock.handle(), sock.handle()
+assert(client:socket(proxy_in))
+
+local proxy_out, server = sock.handle(), sock.handle()
+assert(proxy_out:socket(server))
+
+-- mirror of proxied data
+local mirror_r, mirror_w = sys.handle(), sys.handle()
+assert(mirror_r:pipe(mirror_w))
+
+local msg = "data moved by kernel"
+assert(client:write(msg))
+
+local count, pending, mirrored = assert(proxy_in:proxy_to(proxy_out, nil, mirror_w))
+assert(count == #msg and pending == 0 and mirrored == #msg)
+assert(server:read(#msg) == msg)
+assert(mirror_r:read(#msg) == msg)
+
+-- Only socket and file handles are accepted
+assert(not pcall(sock.splice, sock.addr(), proxy_out))
+assert(not pcall(proxy_in.proxy_to, proxy_in, proxy_out, nil, sock.addr()))
+
+-- Non-blocking: nothing to move
+assert(proxy_in:nonblocking(true))
+assert(proxy_in:proxy_to(proxy_out) == false)
+
+-- Explicit splice through pipe
+local pipe_r, pipe_w = sys.handle(), sys.handle()
+assert(pipe_r:pipe(pipe_w))
+
+assert(client:write(msg))
+assert(sock.splice(proxy_in, pipe_w) == #msg)
+assert(sock.tee(pipe_r, mirror_w) == #msg)
+assert(sock.splice(pipe_r, proxy_out, #msg, "move") == #msg)
+assert(server:read(#msg) == msg)
+assert(mirror_r:read(#msg) == msg)
+
+-- EOF
+client:close()
+count, pending = proxy_in:proxy_to(proxy_out)
+assert(count == 0 and pending == 0)
+
+print"OK"
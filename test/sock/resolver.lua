@@ -0,0 +1,53 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local resolver = assert(sock.resolver(2, 1000))
+local evq = assert(sys.event_queue())
+
+local hosts = {"localhost", "127.0.0.1", "no-such-host.invalid"}
+local queries = {}
+
+for _, host in ipairs(hosts) do
+	local id = assert(resolver:resolve(host))
+	assert(type(id) == "number")
+	queries[id] = host
+end
+
+-- Concurrent resolves of the same host share the query
+local id = resolver:resolve("localhost")
+assert(queries[id] == "localhost")
+
+local nleft = #hosts
+assert(evq:add(resolver, "r", function(evq, evid)
+	for id, res in pairs(resolver:results()) do
+		local host = queries[id]
+		if type(res) == "table" then
+			for i, addr in ipairs(res) do
+				print(host, sock.inet_ntop(addr))
+			end
+		else
+			print(host, "error:", res)
+		end
+		nleft = nleft - 1
+	end
+	if nleft == 0 then
+		evq:del(evid)
+	end
+end))
+
+assert(evq:loop(5000))
+assert(nleft == 0)
+
+-- Cached answer
+local addrs = resolver:resolve("localhost")
+assert(type(addrs) == "table" and #addrs > 0)
+
+-- Failed query is not pending anymore
+assert(type(resolver:resolve("no-such-host.invalid")) == "number")
+
+resolver:close()
+
+print"OK"
@@ -0,0 +1,38 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1313
+local host = "127.0.0.1"
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local rfd = sock.handle()
+assert(rfd:socket("dgram"))
+assert(rfd:sockopt("udp_gro", 1))
+assert(rfd:bind(saddr))
+
+local sfd = sock.handle()
+assert(sfd:socket("dgram"))
+
+-- Send one buffer split by kernel into segments
+local data = "0123456789abcdefghijklm"
+local seg_size = 10
+assert(sfd:send_gso(data, seg_size, saddr) == #data)
+
+-- Receive coalesced segments
+local buf = sys.mem.pointer():alloc()
+local offsets, from = {}, sock.addr()
+local n = assert(rfd:recv_gro(buf, offsets, from))
+assert(n == 3)
+
+local s = buf:tostring()
+for i = 1, n do
+	assert(s:sub(offsets[i] + 1, offsets[i + 1])
+		== data:sub((i - 1) * seg_size + 1, i * seg_size))
+end
+
+print"OK"
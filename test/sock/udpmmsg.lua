@@ -0,0 +1,51 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1313
+local host = "127.0.0.1"
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local rfd = sock.handle()
+assert(rfd:socket("dgram"))
+assert(rfd:bind(saddr))
+
+local sfd = sock.handle()
+assert(sfd:socket("dgram"))
+
+-- Send batch of packets
+local packets = {"first", "second", "", "fourth packet"}
+local offsets, off = {}, 0
+for i, s in ipairs(packets) do
+	offsets[i] = off
+	off = off + #s
+end
+offsets[#packets + 1] = off
+
+assert(sfd:send_many(table.concat(packets), offsets, saddr) == #packets)
+
+-- Receive batch of packets
+local buf = sys.mem.pointer():alloc()
+local roffsets, from = {}, {}
+local n = assert(rfd:recv_many(buf, 16, 1500, roffsets, from))
+assert(n == #packets)
+
+local data = buf:tostring()
+for i = 1, n do
+	local s = data:sub(roffsets[i] + 1, roffsets[i + 1])
+	assert(s == packets[i])
+	assert(sock.inet_ntop(select(2, from[i]:inet())) == host)
+end
+
+-- Only socket addresses are filled
+assert(not pcall(rfd.recv_many, rfd, buf, 16, 1500, roffsets, {buf}))
+
+-- Packet size is bounded by datagram payload
+assert(not pcall(rfd.recv_many, rfd, buf, 16, 65536, roffsets))
+assert(not pcall(rfd.recv_many, rfd, buf, 16, -1, roffsets))
+
+print"OK"
@@ -0,0 +1,70 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+local sock = require"sys.sock"
+
+
+local port = 1313
+local host = "127.0.0.1"
+
+local saddr = assert(sock.addr())
+assert(saddr:inet(port, sock.inet_pton(host)))
+
+local listener = sock.handle()
+assert(listener:socket())
+assert(listener:sockopt("reuseaddr", 1))
+assert(listener:bind(saddr))
+assert(listener:listen())
+
+local client = sock.handle()
+assert(client:socket())
+assert(client:connect(saddr))
+
+local server = sock.handle()
+assert(listener:accept(server))
+
+-- Buffer is pinned until completion
+local buf = sys.mem.pointer():alloc()
+buf:write(("0123456789"):rep(10000))
+
+local nw, send_id = assert(client:send_zc(buf))
+assert(nw == 100000 and send_id == 0)
+
+local evq = assert(sys.event_queue())
+local completed
+
+evq:add_socket(client, "zerocopy", function(evq, evid, fd)
+	local count, copied = fd:zc_complete()
+	if count then
+		print("completed:", count, "copied:", copied)
+		completed = true
+		evq:del(evid)
+	end
+end)
+
+local data = {}
+evq:add_socket(server, "r", function(evq, evid, fd)
+	local s = fd:read()
+	if s then
+		data[#data + 1] = s
+	end
+	if #table.concat(data) == nw then
+		evq:del(evid)
+	end
+end)
+
+assert(evq:loop(1000))
+assert(completed)
+assert(table.concat(data) == buf:tostring())
+
+-- Destination address argument
+local urecv, usend = sock.handle(), sock.handle()
+assert(urecv:socket("dgram"))
+assert(urecv:bind(saddr))
+assert(usend:socket("dgram"))
+
+local msg = "datagram"
+assert(usend:send_zc(msg, sock.addr():inet(port, sock.inet_pton(host))))
+assert(urecv:recv() == msg)
+
+print"OK"
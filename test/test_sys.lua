@@ -73,6 +73,40 @@ do
 end
 
 
+print"-- File ranges: sendfile, copy_file_range"
+do
+  local s = "0123456789abcdef"
+  local src = assert(sys.handle():create("test_src"))
+  assert(src:write(s))
+  src:close()
+  src = assert(sys.handle():open("test_src"))
+
+  -- sendfile with offset doesn't change file position
+  local fdi, fdo = sock.handle(), sock.handle()
+  assert(fdi:socket(fdo))
+  assert(fdo:sendfile(src, 4, 10) == 4)
+  assert(fdi:read(4) == "abcd")
+  assert(src:seek(0) == 0)
+  fdi:close()
+  fdo:close()
+
+  -- copy_file_range
+  local dst = assert(sys.handle():create("test_dst"))
+  assert(sys.copy_file_range(src, dst, 2, 0, 8) == 8)
+  assert(sys.copy_file_range(src, dst, nil, 8) == #s)
+  assert(src:seek(0, "cur") == #s)
+  dst:close()
+  src:close()
+
+  dst = assert(sys.handle():open("test_dst"))
+  assert(dst:read() == s:sub(3, 10) .. s)
+  dst:close()
+  sys.remove"test_src"
+  sys.remove"test_dst"
+  print("OK")
+end
+
+
 print"-- Interface List"
 do
   local ifaddrs = assert(sock.getifaddrs())
@@ -55,3 +55,50 @@ end
 -- Wait threads termination
 assert(consumer:wait())
 assert(producer:wait())
+
+
+-- Native Data Pool
+do
+  local dpool = assert(thread.data_pool(1024))
+
+  local function produce()
+    for i = 1, 1000 do
+      dpool:put(i, "item")
+    end
+  end
+
+  local producer = assert(thread.run(produce))
+
+  local n, sum = 0, 0
+  while n < 1000 do
+    local items = {dpool:get_many(100, 1000)}
+    assert(items[1], "timed out")
+    local i = 1
+    while items[i] do  -- count, data_items ...
+      assert(items[i] == 2 and items[i + 2] == "item")
+      sum = sum + items[i + 1]
+      n, i = n + 1, i + 3
+    end
+  end
+  assert(sum == 500500)
+  assert(producer:wait() == 0)
+  assert(#dpool == 0)
+
+  -- Put on full callback
+  local function on_full(dpool, ...)
+    return "full", ...
+  end
+
+  dpool:callbacks(on_full)
+  dpool:max(1)
+  dpool:put(1, "a")
+  dpool:put(2, "b")
+  local items = {dpool:get_many(2)}
+  assert(#items == 7 and items[4] == 3)
+  assert(items[5] == "full" and items[6] == 2 and items[7] == "b")
+
+  -- Full userdata can't be kept
+  assert(not pcall(dpool.put, dpool, dpool))
+  assert(not pcall(dpool.put, dpool, 1, io.stdout))
+  assert(#dpool == 0)
+end
@@ -0,0 +1,39 @@
+#!/usr/bin/env lua
+
+local sys = require"sys"
+
+local thread = sys.thread
+assert(thread.init())
+
+
+local NTASKS = 1000 * 1000
+local NWAVES = 10  -- keep many tasks alive to grow the tasks storage
+
+-- Scheduler
+local sched = assert(thread.scheduler())
+
+local count = 0
+
+local function process()
+  count = count + 1
+end
+
+local period = sys.period()
+
+period:start()
+do
+  local nwave = NTASKS / NWAVES
+
+  for wave = 1, NWAVES do
+    for i = 1, nwave do
+      assert(sched:put(process))
+    end
+    assert(sched:loop(nil, true))
+  end
+end
+local duration = period:get() / 1e6
+
+assert(count == NTASKS)
+
+print("ntasks:", NTASKS)
+print(duration .. " seconds")
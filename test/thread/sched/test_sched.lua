@@ -54,10 +54,202 @@ do
 end
 
 
+print("-- Work-stealing")
+do
+  local ws = assert(thread.scheduler(nil, nil, nil, nil, true))
+  local NTASKS, NWORKERS = 100, 3
+  local count = 0
+
+  local function task()
+    coroutine.yield()
+    count = count + 1
+  end
+
+  local function spawn()
+    assert(ws:put(task))
+    task()
+  end
+
+  for i = 1, NTASKS do
+    assert(ws:put(spawn))
+  end
+
+  local workers = {}
+  for i = 1, NWORKERS do
+    workers[i] = assert(thread.run(ws.loop, ws, 100))
+  end
+  for i = 1, NWORKERS do
+    workers[i]:wait()
+  end
+  assert(count == NTASKS * 2, "count: " .. count)
+  assert(ws:size() == 0)
+
+  -- Tasks are taken over by other workers, while the VM lock is released
+  local seen, nseen = {}, 0
+
+  local function where()
+    for i = 1, 10 do
+      local id = tostring(thread.self())
+      if not seen[id] then
+        seen[id] = true
+        nseen = nseen + 1
+      end
+      thread.sleep(1)  -- release the VM lock
+      coroutine.yield()
+    end
+  end
+
+  for i = 1, NTASKS / 10 do
+    assert(ws:put(where))
+  end
+  for i = 1, NWORKERS do
+    workers[i] = assert(thread.run(ws.loop, ws, 100))
+  end
+  for i = 1, NWORKERS do
+    workers[i]:wait()
+  end
+  assert(ws:size() == 0)
+  assert(nseen > 1, "workers: " .. nseen)
+end
+
+
+print("-- Priorities")
+do
+  local ps = assert(thread.scheduler())
+  local order = {}
+
+  local function test(name)
+    order[#order + 1] = name
+  end
+
+  local low = assert(ps:put(test, "low"))
+  assert(ps:put(test, "normal"))
+  local high = assert(ps:put(test, "high"))
+
+  assert(ps:priority(low, "low"))
+  assert(ps:priority(high, "high"))
+  assert(ps:priority(high) == "high")
+
+  assert(ps:loop(nil, true))
+  assert(table.concat(order, " ") == "high normal low")
+
+  -- Starvation protection
+  local bulk_done
+
+  local function interactive()
+    while not bulk_done do
+      coroutine.yield()
+    end
+  end
+
+  local function bulk()
+    bulk_done = true
+  end
+
+  for i = 1, 4 do
+    assert(ps:priority(assert(ps:put(interactive)), "high"))
+  end
+  assert(ps:priority(assert(ps:put(bulk)), "low"))
+
+  assert(ps:loop(nil, true))
+
+  -- Starvation protection in work-stealing mode
+  local ws = assert(thread.scheduler(nil, nil, nil, nil, true))
+  local nyields
+
+  local function yielder(name)
+    while not bulk_done do
+      nyields = nyields + 1
+      assert(nyields < 1000, name .. " priority task starved")
+      coroutine.yield()
+    end
+  end
+
+  -- normal tasks are in the worker's deque, low task is waiting
+  bulk_done, nyields = nil, 0
+  for i = 1, 4 do
+    assert(ws:put(yielder, "low"))
+  end
+  assert(ws:priority(assert(ws:put(bulk)), "low"))
+  assert(ws:loop(nil, true))
+
+  -- high tasks are running, normal task is waiting in the deque
+  local function spawn()
+    assert(ws:put(bulk))
+    yielder("normal")
+  end
+
+  bulk_done, nyields = nil, 0
+  for i = 1, 4 do
+    assert(ws:priority(assert(ws:put(yielder, "normal")), "high"))
+  end
+  assert(ws:priority(assert(ws:put(spawn)), "high"))
+  assert(ws:loop(nil, true))
+end
+
+
+print("-- Sleep")
+do
+  local ss = assert(thread.scheduler())
+  local order = {}
+
+  local function test(msec)
+    ss:sleep(msec)
+    order[#order + 1] = msec
+  end
+
+  assert(ss:put(test, 30))
+  assert(ss:put(test, 10))
+  assert(ss:put(test, 20))
+  local task = assert(ss:put(test, 1000))
+
+  local function terminator()
+    ss:sleep(40)
+    assert(ss:terminate(task))
+  end
+
+  assert(ss:put(terminator))
+
+  assert(ss:loop(100) == false)
+  assert(table.concat(order, " ") == "10 20 30")
+  assert(ss:size() == 0)
+end
+
+
+print("-- Stats")
+do
+  local ss = assert(thread.scheduler())
+  assert(ss:accounting(true) == ss)
+  assert(ss:accounting())
+
+  local function busy()
+    local x = 0
+    for i = 1, 100000 do x = x + i end
+    coroutine.yield()
+    ss:sleep(1000)
+  end
+
+  local task = assert(ss:put(busy))
+  assert(ss:put(function() ss:sleep(1000) end))
+  assert(ss:put(function() coroutine.yield() end))
+
+  local stats = ss:stats()
+  assert(stats.tasks == 3 and stats.runnable == 3)
+
+  assert(ss:loop(20) == false)
+  assert(ss:stats(task) > 0)
+
+  stats = ss:stats()
+  assert(stats.tasks == 2 and stats.sleeping == 2)
+  assert(stats.resumes >= 5)
+  assert(stats.busy_time > 0 and stats.wait_max >= 0)
+  assert(stats.utilisation > 0 and stats.utilisation <= 1)
+end
+
+
 print("-- Preemptive multi-tasking")
 do
-  assert(thread.run(sched.preempt_tasks, sched, 50))
-  thread.sleep(10)
+  assert(sched:preempt_tasks(50) == sched)
 
   local condition
 
@@ -37,4 +37,255 @@ do
 end
 
 
+print"-- VM-lock contention"
+do
+  local opts = thread.vmlock{spin = 50, handoff = true}
+  assert(opts.spin_max == 50 and opts.handoff)
+
+  local function work()
+    for i = 1, 1000 do
+      thread.yield()
+    end
+  end
+
+  local td1 = assert(thread.run(work))
+  local td2 = assert(thread.run(work))
+  assert(td1:wait() == 0 and td2:wait() == 0)
+
+  local stats = thread.vmlock{spin = 100, handoff = false}
+  assert(stats.locks > opts.locks + 2000)
+  assert(stats.contended >= stats.parks)
+  print"OK"
+end
+
+
+print"-- CPU topology and placement"
+do
+  local cpus = assert(thread.topology())
+  assert(#cpus == thread.nprocs())
+  assert(cpus[1].id)
+  for i, cpu in ipairs(cpus) do
+    assert(cpu.cpu == i)  -- offset for placement options
+    local siblings = cpu.siblings
+    if siblings then  -- SMT siblings include the processor itself
+      local found
+      for _, off in ipairs(siblings) do
+        assert(cpus[off])
+        found = found or (off == cpu.cpu)
+      end
+      assert(found)
+    end
+  end
+
+  local function work(work_pipe)
+    require"sys"
+    work_pipe:put(true)
+  end
+
+  local work_pipe = thread.pipe()
+  assert(thread.runvm({cpus = {cpus[#cpus].cpu}, node = cpus[#cpus].node},
+    string.dump(work), work_pipe))
+  assert(select(2, work_pipe:get()))
+
+  assert(thread.run({cpus = {cpus[1].cpu}}, function()
+    work_pipe:put(true)
+  end))
+  assert(select(2, work_pipe:get()))
+  assert(not pcall(thread.run, {cpus = {0}}, function() end))
+
+  assert(not pcall(thread.runvm, {cpus = {#cpus + 1}}, string.dump(work)))
+  print"OK"
+end
+
+
+print"-- VM pool"
+do
+  local function init()
+    pool_inited = true
+    require"sys"
+  end
+
+  local function job(work_pipe, i)
+    work_pipe:put(i, pool_inited)
+  end
+
+  local pool = assert(thread.vm_pool{size = 2, init = string.dump(init)})
+  assert(pool:size() == 2)
+
+  local work_pipe = thread.pipe()
+  local func = string.dump(job)
+  local sum = 0
+
+  for i = 1, 10 do
+    assert(pool:run(func, work_pipe, i))
+  end
+  for i = 1, 10 do
+    local _, num, inited = work_pipe:get()
+    assert(inited)
+    sum = sum + num
+  end
+  assert(sum == 55)
+
+  -- bad arguments don't leave the VM-thread locked
+  assert(not pcall(pool.run, pool, func, work_pipe, {}))
+  assert(not pcall(pool.run, pool, "no-such-file.lua"))
+  assert(pool:run(func, work_pipe, 1))
+  assert(select(2, work_pipe:get()) == 1)
+
+  -- close waits for the running job
+  local function slow_job(work_pipe)
+    local thread = require"sys".thread
+    thread.sleep(100)
+    work_pipe:put(true)
+  end
+  assert(pool:run(string.dump(slow_job), work_pipe))
+
+  pool:close()
+  assert(work_pipe:get(0))
+  assert(not pcall(pool.run, pool, func))
+  print"OK"
+end
+
+
+print"-- Shared snapshot"
+do
+  local routes = {
+    name = "routes", enabled = true, [0.5] = "half",
+    "a", "b", "c",
+    hosts = {["example.com"] = {port = 80}, ["example.org"] = {port = 443}},
+  }
+  routes.self = routes
+
+  local snap = assert(thread.snapshot(routes))
+  assert(snap.name == "routes" and snap.enabled == true)
+  assert(snap[0.5] == "half" and snap.missing == nil)
+  assert(snap[0/0] == nil)
+  assert(snap.dump == nil and snap.close == nil and snap.__gc == nil)
+  assert(#snap == 3 and snap[1] == "a" and snap[3] == "c")
+  assert(snap.hosts["example.org"].port == 443)
+  assert(snap.self.self.name == "routes")
+
+  local n = 0
+  for k, v in thread.snapshot_pairs(snap) do
+    n = n + 1
+  end
+  assert(n == 8)
+
+  assert(not pcall(thread.snapshot, {f = print}))
+
+  local function worker(work_pipe, snap)
+    local sys = require"sys"
+    work_pipe:put(snap.hosts["example.com"].port, #snap)
+  end
+
+  local work_pipe = thread.pipe()
+  local td = assert(thread.runvm(nil, string.dump(worker), work_pipe, snap))
+  local _, port, len = work_pipe:get()
+  assert(port == 80 and len == 3)
+  assert(td:wait() == 0)
+
+  local image = thread.snapshot_dump(snap.hosts)
+  local hosts = assert(thread.snapshot(image))
+  assert(hosts["example.com"].port == 80)
+  assert(not pcall(thread.snapshot, "garbage"))
+
+  -- string out of image bounds
+  local hdr = 16
+  local pos = image:find("example.org", hdr + 1, true)
+  assert(pos)
+  local off = string.char((pos - 1) % 256, math.floor((pos - 1) / 256))
+  local bad = image:gsub(off .. "%z%z", "\255\255\0\0", 1)
+  assert(bad ~= image)
+  assert(not pcall(thread.snapshot, bad))
+
+  if thread.snapshot_map then
+    local path = os.tmpname()
+    local fd = assert(io.open(path, "wb"))
+    fd:write(thread.snapshot_dump(snap))
+    fd:close()
+
+    local mapped = assert(thread.snapshot_map(path))
+    os.remove(path)
+    assert(mapped.hosts["example.org"].port == 443)
+    thread.snapshot_close(mapped)
+  end
+  print"OK"
+end
+
+
+print"-- Channels and select"
+do
+  local function producer(ch, from, to)
+    for i = from, to do
+      ch:put(i)
+    end
+    ch:close()
+  end
+
+  local ch1, ch2 = thread.channel(), thread.channel(4)
+  local func = string.dump(producer)
+
+  assert(thread.select({ch1, ch2}, 10) == false)
+
+  local td1 = assert(thread.runvm(nil, func, ch1, 1, 100))
+  local td2 = assert(thread.runvm(nil, func, ch2, 101, 200))
+
+  local sum, nclosed = 0, 0
+  local chans = {ch1, ch2}
+  while nclosed < 2 do
+    local ch, num = thread.select(chans)
+    assert(ch == ch1 or ch == ch2)
+    if num then
+      sum = sum + num
+    else
+      nclosed = nclosed + 1
+      for i, v in ipairs(chans) do
+        if v == ch then table.remove(chans, i) end
+      end
+    end
+  end
+  assert(sum == 20100)
+  assert(td1:wait() == 0 and td2:wait() == 0)
+
+  assert(not pcall(ch1.put, ch1, 1))
+  assert(ch1:get() == ch1)
+  print"OK"
+end
+
+
+print"-- Thread stack size and guard"
+do
+  local function deep(n)
+    if n > 0 then return 1 + deep(n - 1) end
+    return 0
+  end
+
+  local td = assert(thread.run({stack_size = 256 * 1024, guard = 8192,
+    stack_peak = true}, function() return deep(100) end))
+  assert(td:wait() == 100)
+
+  local size, guard, peak = td:stack()
+  assert(size == 256 * 1024 and guard == 8192)
+  assert(not peak or peak < size)
+
+  td = assert(thread.run({stack_size = 32 * 1024}, deep, 10))
+  assert(td:wait() == 10)
+  assert(td:stack() == 32 * 1024)
+
+  local function worker()
+    return 7
+  end
+
+  td = assert(thread.runvm({stack_size = 128 * 1024, stack_peak = true},
+    string.dump(worker)))
+  assert(td:wait() == 7)
+  size, guard, peak = td:stack()
+  assert(size == 128 * 1024 and guard == nil)
+  assert(not peak or peak < size)
+
+  assert(not pcall(thread.run, {stack_size = -1}, deep, 1))
+  print"OK"
+end
+
+
 assert(thread.self():wait())